@@ -0,0 +1,432 @@
+//! Just enough of the Arrow IPC streaming format to write record batches of
+//! non-null `UInt64` and `Utf8` columns, without pulling in the arrow crate,
+//! and to read back streams written that way.
+
+use std::io::{self, Read, Write};
+
+pub enum Column {
+    UInt64(Vec<u64>),
+    Utf8 { offsets: Vec<i32>, data: Vec<u8> },
+}
+
+pub enum Type {
+    UInt64,
+    Utf8,
+}
+
+const METADATA_V5: i16 = 4;
+const HEADER_SCHEMA: u8 = 1;
+const HEADER_RECORD_BATCH: u8 = 3;
+const TYPE_INT: u8 = 2;
+const TYPE_UTF8: u8 = 5;
+
+/// Writes the schema message that opens a stream, returning its length.
+pub fn write_schema(out: &mut impl Write, fields: &[(&str, Type)]) -> io::Result<u64> {
+    let mut builder = Builder::default();
+
+    let mut field_offsets = Vec::new();
+    for (name, kind) in fields {
+        let children = builder.offset_vector(&[]);
+        let (type_type, type_offset) = match kind {
+            Type::UInt64 => {
+                let int = builder.table(&[(0, Value::I32(64)), (1, Value::Bool(false))]);
+                (TYPE_INT, int)
+            }
+            Type::Utf8 => (TYPE_UTF8, builder.table(&[])),
+        };
+        let name = builder.string(name);
+        field_offsets.push(builder.table(&[
+            (0, Value::Offset(name)),
+            (1, Value::Bool(false)),
+            (2, Value::U8(type_type)),
+            (3, Value::Offset(type_offset)),
+            (5, Value::Offset(children)),
+        ]));
+    }
+    let fields = builder.offset_vector(&field_offsets);
+    let schema = builder.table(&[(1, Value::Offset(fields))]);
+
+    let metadata = metadata(builder, HEADER_SCHEMA, schema, 0);
+    write_message(out, &metadata, &[])
+}
+
+/// Writes one record batch, returning its length; every column must hold
+/// `length` values.
+pub fn write_batch(out: &mut impl Write, length: usize, columns: &[Column]) -> io::Result<u64> {
+    let (builder, batch, body) = encode_batch(length, columns);
+    let metadata = metadata(builder, HEADER_RECORD_BATCH, batch, body.len());
+    write_message(out, &metadata, &body)
+}
+
+/// Writes one record batch like `write_batch`, with its body padded so
+/// that it takes exactly `size` bytes, to overwrite a batch that held at
+/// least as much data. Readers find buffers by their offsets, so they skip
+/// the padding.
+pub fn rewrite_batch(
+    out: &mut impl Write,
+    length: usize,
+    columns: &[Column],
+    size: u64,
+) -> io::Result<()> {
+    let (builder, batch, mut body) = encode_batch(length, columns);
+    // The body's length is a fixed-width field, so it does not change the
+    // metadata's size.
+    let fixed = 8 + metadata(builder.clone(), HEADER_RECORD_BATCH, batch, 0).len();
+    let Some(padded) = (size as usize)
+        .checked_sub(fixed)
+        .filter(|&padded| padded >= body.len())
+    else {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidInput,
+            "record batch outgrew its place",
+        ));
+    };
+    body.resize(padded, 0);
+    let metadata = metadata(builder, HEADER_RECORD_BATCH, batch, body.len());
+    write_message(out, &metadata, &body).map(drop)
+}
+
+fn encode_batch(length: usize, columns: &[Column]) -> (Builder, usize, Vec<u8>) {
+    let mut nodes = Vec::new();
+    let mut buffers = Vec::new();
+    let mut body = Vec::new();
+    let mut push_buffer = |body: &mut Vec<u8>, bytes: &[u8]| {
+        buffers.push((body.len() as i64, bytes.len() as i64));
+        body.extend_from_slice(bytes);
+        body.resize(body.len().next_multiple_of(8), 0);
+    };
+
+    for column in columns {
+        nodes.push((length as i64, 0i64));
+        push_buffer(&mut body, &[]);
+        match column {
+            Column::UInt64(values) => {
+                let bytes: Vec<u8> = values
+                    .iter()
+                    .flat_map(|value| value.to_le_bytes())
+                    .collect();
+                push_buffer(&mut body, &bytes);
+            }
+            Column::Utf8 { offsets, data } => {
+                let bytes: Vec<u8> = offsets
+                    .iter()
+                    .flat_map(|value| value.to_le_bytes())
+                    .collect();
+                push_buffer(&mut body, &bytes);
+                push_buffer(&mut body, data);
+            }
+        }
+    }
+
+    let mut builder = Builder::default();
+    let buffers = builder.struct_vector(&buffers);
+    let nodes = builder.struct_vector(&nodes);
+    let batch = builder.table(&[
+        (0, Value::I64(length as i64)),
+        (1, Value::Offset(nodes)),
+        (2, Value::Offset(buffers)),
+    ]);
+    (builder, batch, body)
+}
+
+/// The marker that ends a stream.
+pub const END: [u8; 8] = [0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0];
+
+pub fn write_end(out: &mut impl Write) -> io::Result<()> {
+    out.write_all(&END)
+}
+
+/// One message of a stream, as read back by `read_message`.
+pub enum Message {
+    Schema,
+    /// A record batch's columns.
+    Batch(Vec<Column>),
+}
+
+/// Reads the next message of a stream this module wrote, with `fields` as
+/// its schema, and the number of bytes it took. Returns `None` at the end
+/// of the stream.
+pub fn read_message(
+    input: &mut impl Read,
+    fields: &[(&str, Type)],
+) -> io::Result<Option<(Message, u64)>> {
+    let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not a dirsize Arrow stream");
+    let mut prefix = [0; 8];
+    input.read_exact(&mut prefix)?;
+    let length = i32::from_le_bytes(prefix[4..].try_into().unwrap());
+    if prefix[..4] != [0xff; 4] || length < 0 {
+        return Err(invalid());
+    }
+    if length == 0 {
+        return Ok(None);
+    }
+    let mut metadata = vec![0; length as usize];
+    input.read_exact(&mut metadata)?;
+    let message = Table::root(&metadata).ok_or_else(invalid)?;
+    let body_length = message.i64(3).ok_or_else(invalid)?;
+    let mut body = vec![0; usize::try_from(body_length).map_err(|_| invalid())?];
+    input.read_exact(&mut body)?;
+    let read = 8 + metadata.len() as u64 + body.len() as u64;
+
+    match message.u8(1) {
+        Some(HEADER_SCHEMA) => Ok(Some((Message::Schema, read))),
+        Some(HEADER_RECORD_BATCH) => {
+            let batch = message.table(2).ok_or_else(invalid)?;
+            let length = batch.i64(0).ok_or_else(invalid)? as usize;
+            let mut buffers =
+                batch
+                    .pairs(2)
+                    .ok_or_else(invalid)?
+                    .into_iter()
+                    .map(|(offset, size)| {
+                        body.get(offset as usize..(offset + size) as usize)
+                            .ok_or_else(invalid)
+                    });
+            let mut columns = Vec::with_capacity(fields.len());
+            for (_, kind) in fields {
+                buffers.next().ok_or_else(invalid)??;
+                let values = buffers.next().ok_or_else(invalid)??;
+                columns.push(match kind {
+                    Type::UInt64 => Column::UInt64(
+                        values
+                            .chunks_exact(8)
+                            .take(length)
+                            .map(|word| u64::from_le_bytes(word.try_into().unwrap()))
+                            .collect(),
+                    ),
+                    Type::Utf8 => Column::Utf8 {
+                        offsets: values
+                            .chunks_exact(4)
+                            .take(length + 1)
+                            .map(|word| i32::from_le_bytes(word.try_into().unwrap()))
+                            .collect(),
+                        data: buffers.next().ok_or_else(invalid)??.to_vec(),
+                    },
+                });
+            }
+            Ok(Some((Message::Batch(columns), read)))
+        }
+        _ => Err(invalid()),
+    }
+}
+
+/// A flatbuffer table in `bytes`, read only as far as the messages this
+/// module writes need.
+struct Table<'a> {
+    bytes: &'a [u8],
+    position: usize,
+}
+
+impl<'a> Table<'a> {
+    fn root(bytes: &'a [u8]) -> Option<Table<'a>> {
+        Some(Table {
+            bytes,
+            position: read_u32(bytes, 0)? as usize,
+        })
+    }
+
+    /// Where field `id` is stored, if it is present.
+    fn field(&self, id: usize) -> Option<usize> {
+        let vtable = self.position.checked_sub(i32::from_le_bytes(
+            self.bytes
+                .get(self.position..self.position + 4)?
+                .try_into()
+                .ok()?,
+        ) as usize)?;
+        let size =
+            u16::from_le_bytes(self.bytes.get(vtable..vtable + 2)?.try_into().ok()?) as usize;
+        if 4 + 2 * id >= size {
+            return None;
+        }
+        let start = vtable + 4 + 2 * id;
+        match u16::from_le_bytes(self.bytes.get(start..start + 2)?.try_into().ok()?) {
+            0 => None,
+            offset => Some(self.position + offset as usize),
+        }
+    }
+
+    fn u8(&self, id: usize) -> Option<u8> {
+        self.bytes.get(self.field(id)?).copied()
+    }
+
+    fn i64(&self, id: usize) -> Option<i64> {
+        let start = self.field(id)?;
+        Some(i64::from_le_bytes(
+            self.bytes.get(start..start + 8)?.try_into().ok()?,
+        ))
+    }
+
+    /// The target of the offset in field `id`.
+    fn target(&self, id: usize) -> Option<usize> {
+        let start = self.field(id)?;
+        Some(start + read_u32(self.bytes, start)? as usize)
+    }
+
+    fn table(&self, id: usize) -> Option<Table<'a>> {
+        Some(Table {
+            bytes: self.bytes,
+            position: self.target(id)?,
+        })
+    }
+
+    /// A vector of `{ long, long }` structs.
+    fn pairs(&self, id: usize) -> Option<Vec<(u64, u64)>> {
+        let start = self.target(id)?;
+        let count = read_u32(self.bytes, start)? as usize;
+        let pairs = self.bytes.get(start + 4..start + 4 + count * 16)?;
+        Some(
+            pairs
+                .chunks_exact(16)
+                .map(|pair| {
+                    (
+                        u64::from_le_bytes(pair[..8].try_into().unwrap()),
+                        u64::from_le_bytes(pair[8..].try_into().unwrap()),
+                    )
+                })
+                .collect(),
+        )
+    }
+}
+
+fn read_u32(bytes: &[u8], start: usize) -> Option<u32> {
+    Some(u32::from_le_bytes(
+        bytes.get(start..start + 4)?.try_into().ok()?,
+    ))
+}
+
+fn metadata(mut builder: Builder, header_type: u8, header: usize, body_length: usize) -> Vec<u8> {
+    let message = builder.table(&[
+        (0, Value::I16(METADATA_V5)),
+        (1, Value::U8(header_type)),
+        (2, Value::Offset(header)),
+        (3, Value::I64(body_length as i64)),
+    ]);
+    builder.finish(message)
+}
+
+/// Writes a message, returning its length.
+fn write_message(out: &mut impl Write, metadata: &[u8], body: &[u8]) -> io::Result<u64> {
+    out.write_all(&[0xff, 0xff, 0xff, 0xff])?;
+    out.write_all(&(metadata.len() as i32).to_le_bytes())?;
+    out.write_all(metadata)?;
+    out.write_all(body)?;
+    Ok(8 + metadata.len() as u64 + body.len() as u64)
+}
+
+enum Value {
+    Bool(bool),
+    U8(u8),
+    I16(i16),
+    I32(i32),
+    I64(i64),
+    Offset(usize),
+}
+
+/// Minimal flatbuffer builder. Like the reference implementation it builds
+/// back to front, so every object is addressed by its distance from the
+/// end of the buffer and children are always written before their parents.
+#[derive(Clone, Default)]
+struct Builder {
+    bytes: Vec<u8>,
+}
+
+impl Builder {
+    fn position(&self) -> usize {
+        self.bytes.len()
+    }
+
+    fn prepend(&mut self, bytes: &[u8]) {
+        self.bytes.splice(0..0, bytes.iter().copied());
+    }
+
+    /// Pads so that the next `size` bytes prepended end up `align`-aligned.
+    fn align(&mut self, align: usize, size: usize) {
+        let padding = (align - (self.bytes.len() + size) % align) % align;
+        self.prepend(&vec![0; padding]);
+    }
+
+    fn offset(&mut self, target: usize) {
+        self.align(4, 4);
+        let relative = (self.position() + 4 - target) as u32;
+        self.prepend(&relative.to_le_bytes());
+    }
+
+    fn string(&mut self, text: &str) -> usize {
+        self.align(4, text.len() + 1 + 4);
+        self.prepend(&[0]);
+        self.prepend(text.as_bytes());
+        self.prepend(&(text.len() as u32).to_le_bytes());
+        self.position()
+    }
+
+    fn offset_vector(&mut self, targets: &[usize]) -> usize {
+        for &target in targets.iter().rev() {
+            self.offset(target);
+        }
+        self.align(4, 4);
+        self.prepend(&(targets.len() as u32).to_le_bytes());
+        self.position()
+    }
+
+    /// Vector of `{ long, long }` structs, which is the layout of both
+    /// `FieldNode` and `Buffer`.
+    fn struct_vector(&mut self, pairs: &[(i64, i64)]) -> usize {
+        self.align(8, pairs.len() * 16);
+        for &(first, second) in pairs.iter().rev() {
+            self.prepend(&second.to_le_bytes());
+            self.prepend(&first.to_le_bytes());
+        }
+        self.prepend(&(pairs.len() as u32).to_le_bytes());
+        self.position()
+    }
+
+    fn table(&mut self, fields: &[(usize, Value)]) -> usize {
+        let end = self.position();
+        let mut slots = Vec::new();
+        for (id, value) in fields.iter().rev() {
+            match value {
+                Value::Bool(value) => self.prepend(&[*value as u8]),
+                Value::U8(value) => self.prepend(&[*value]),
+                Value::I16(value) => {
+                    self.align(2, 2);
+                    self.prepend(&value.to_le_bytes());
+                }
+                Value::I32(value) => {
+                    self.align(4, 4);
+                    self.prepend(&value.to_le_bytes());
+                }
+                Value::I64(value) => {
+                    self.align(8, 8);
+                    self.prepend(&value.to_le_bytes());
+                }
+                Value::Offset(target) => self.offset(*target),
+            }
+            slots.push((*id, self.position()));
+        }
+
+        let slot_count = fields.iter().map(|(id, _)| id + 1).max().unwrap_or(0);
+        let vtable_size = 4 + 2 * slot_count;
+        self.align(4, 4);
+        self.prepend(&(vtable_size as i32).to_le_bytes());
+        let table = self.position();
+
+        let mut vtable = vec![0u16; 2 + slot_count];
+        vtable[0] = vtable_size as u16;
+        vtable[1] = (table - end) as u16;
+        for (id, position) in slots {
+            vtable[2 + id] = (table - position) as u16;
+        }
+        let vtable: Vec<u8> = vtable
+            .iter()
+            .flat_map(|value| value.to_le_bytes())
+            .collect();
+        self.prepend(&vtable);
+        table
+    }
+
+    fn finish(mut self, root: usize) -> Vec<u8> {
+        self.align(8, 4);
+        self.offset(root);
+        self.bytes
+    }
+}
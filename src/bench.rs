@@ -0,0 +1,485 @@
+use crate::listing;
+use crate::options::Options;
+use crate::shape::Buckets;
+use crate::tree::Tree;
+use crate::watch::json_string;
+use rayon::prelude::*;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+pub const DEFAULT_RUNS: usize = 5;
+
+/// Percentiles of the per-directory listing latency, reported in microseconds.
+const PERCENTILES: [(&str, f64); 3] = [("p50", 0.50), ("p90", 0.90), ("p99", 0.99)];
+
+/// Smallest throughput drop `compare` calls a regression, however quiet
+/// the runs were. Noisier results widen it to `NOISE_FACTOR` times the
+/// larger of the two spreads.
+const MIN_THROUGHPUT_TOLERANCE: f64 = 0.05;
+const NOISE_FACTOR: f64 = 3.0;
+/// Allocation counts vary a little with how work is split between threads.
+const ALLOCATION_TOLERANCE: f64 = 0.02;
+const PEAK_MEMORY_TOLERANCE: f64 = 0.10;
+
+static COUNTING: AtomicBool = AtomicBool::new(false);
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+/// The system allocator, counting allocations while a bench profiles a
+/// scan. Outside that run the cost is one relaxed load per allocation.
+pub struct CountingAllocator;
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if COUNTING.load(Ordering::Relaxed) {
+            ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        }
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        if COUNTING.load(Ordering::Relaxed) {
+            ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        }
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+/// The tree every engine scans, counted once up front.
+struct Fixture<'a> {
+    root: &'a Path,
+    runs: usize,
+    directories: u64,
+    entries: u64,
+}
+
+/// Scans `root` `runs` times with every engine and, for the rayon engines,
+/// every power-of-two pool size up to the number of CPUs, and prints one
+/// NDJSON result per engine and setting on stdout. Saved, that output is
+/// the baseline `compare` reads. Scans only read, so this is safe to point
+/// at a production filesystem. An untimed scan runs first to count the
+/// tree and warm the caches, and one more run per setting counts
+/// allocations and peak memory so the timed runs are not slowed by it.
+/// Listing latencies come from the sequential walk and from a parallel
+/// walk at every pool size, which shows how they stretch under load.
+pub fn run(root: &Path, runs: usize) {
+    let tree = Tree::scan(root);
+    let fixture = Fixture {
+        root,
+        runs,
+        directories: tree.nodes.len() as u64,
+        entries: tree.nodes[0].total_entries,
+    };
+    print_shape(root, &tree);
+    drop(tree);
+
+    let mut latencies = Vec::new();
+    bench(&fixture, "sequential", 1, || {
+        latencies.clear();
+        sequential(root, &mut latencies);
+    });
+    print_latency(root, "sequential", 1, &mut latencies);
+
+    let options = Options {
+        root: root.to_owned(),
+        ..Options::default()
+    };
+    for threads in thread_counts() {
+        let pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(threads)
+            .build()
+            .unwrap();
+        bench(&fixture, "parallel", threads, || {
+            let totals = [AtomicU64::new(0)];
+            pool.install(|| {
+                crate::add_directory_size(root, false, 0, &totals, None, None, None, None)
+            });
+        });
+        bench(&fixture, "tree", threads, || {
+            drop(pool.install(|| Tree::scan(root)));
+        });
+        bench(&fixture, "fast-path", threads, || {
+            drop(pool.install(|| crate::directory_sizes(&options, None)));
+        });
+        print_latency(
+            root,
+            "parallel",
+            threads,
+            &mut pool.install(|| parallel(root)),
+        );
+    }
+
+    let workers = crate::devices::workers();
+    bench(&fixture, "per-device", workers, || {
+        let totals = [AtomicU64::new(0)];
+        crate::devices::scan(vec![(0, root.to_owned(), false)], &totals, None, None, None);
+    });
+}
+
+/// One NDJSON line with the tree's fan-out and depth histograms, which say
+/// more about which engine and thread count suit it than its size alone.
+/// The root is at depth 0.
+fn print_shape(root: &Path, tree: &Tree) {
+    let mut buckets = Buckets::default();
+    let mut depths = vec![0; tree.nodes.len()];
+    for (index, node) in tree.nodes.iter().enumerate() {
+        if let Some(parent) = node.parent {
+            depths[index] = depths[parent] + 1;
+        }
+        buckets.record(depths[index], node.entries, node.size);
+    }
+    println!(
+        "{{\"event\":\"shape\",\"path\":{},{}}}",
+        json_string(&root.to_string_lossy()),
+        buckets.json_fields()
+    );
+}
+
+/// 1, 2, 4, ... up to and including the number of CPUs.
+fn thread_counts() -> Vec<usize> {
+    let cpus = std::thread::available_parallelism().map_or(1, |count| count.get());
+    let mut counts: Vec<_> = (0..usize::BITS)
+        .map(|shift| 1 << shift)
+        .take_while(|&count| count < cpus)
+        .collect();
+    counts.push(cpus);
+    counts
+}
+
+/// Single-threaded walk that times every directory listing.
+fn sequential(root: &Path, latencies: &mut Vec<Duration>) {
+    let mut pending: Vec<PathBuf> = vec![root.to_owned()];
+    while let Some(path) = pending.pop() {
+        let started = Instant::now();
+        let listing = listing::list_or_size(&path);
+        latencies.push(started.elapsed());
+        pending.extend(listing.subdirectories);
+    }
+}
+
+/// Rayon walk that times every directory listing, one task per directory
+/// as in the size scan.
+fn parallel(path: &Path) -> Vec<Duration> {
+    let started = Instant::now();
+    let listing = listing::list_or_size(path);
+    let mut latencies = vec![started.elapsed()];
+    latencies.extend(
+        listing
+            .subdirectories
+            .par_iter()
+            .map(|path| parallel(path))
+            .reduce(Vec::new, |mut all, latencies| {
+                all.extend(latencies);
+                all
+            }),
+    );
+    latencies
+}
+
+fn bench(fixture: &Fixture, engine: &str, threads: usize, mut scan: impl FnMut()) {
+    let mut walls = Vec::new();
+    let mut cpus = Vec::new();
+    for _ in 0..fixture.runs {
+        let cpu = cpu_time();
+        let started = Instant::now();
+        scan();
+        walls.push(started.elapsed().as_secs_f64().max(1e-9));
+        cpus.extend(cpu.zip(cpu_time()).map(|(before, after)| after - before));
+    }
+
+    reset_peak_memory();
+    ALLOCATIONS.store(0, Ordering::Relaxed);
+    COUNTING.store(true, Ordering::Relaxed);
+    scan();
+    COUNTING.store(false, Ordering::Relaxed);
+    let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+    let peak_memory = peak_memory().map_or("null".to_owned(), |bytes| bytes.to_string());
+
+    let seconds = median(&mut walls);
+    let spread = median(
+        &mut walls
+            .iter()
+            .map(|wall| (wall - seconds).abs())
+            .collect::<Vec<_>>(),
+    ) / seconds;
+    let cpu = match cpus.len() {
+        0 => "\"cpu_seconds\":null,\"cpu_utilization\":null,\"entries_per_cpu_second\":null"
+            .to_owned(),
+        _ => {
+            let cpu = median(&mut cpus.iter().map(Duration::as_secs_f64).collect::<Vec<_>>());
+            format!(
+                "\"cpu_seconds\":{cpu:.6},\"cpu_utilization\":{:.3},\"entries_per_cpu_second\":{:.0}",
+                cpu / seconds,
+                fixture.entries as f64 / cpu.max(1e-9)
+            )
+        }
+    };
+    println!(
+        "{{\"event\":\"bench\",\"path\":{},\"engine\":{},\"threads\":{threads},\"runs\":{},\"directories\":{},\"entries\":{},\"median_seconds\":{seconds:.6},\"spread\":{spread:.4},\"entries_per_second\":{:.0},{cpu},\"allocations\":{allocations},\"peak_memory_bytes\":{peak_memory}}}",
+        json_string(&fixture.root.to_string_lossy()),
+        json_string(engine),
+        fixture.runs,
+        fixture.directories,
+        fixture.entries,
+        fixture.entries as f64 / seconds
+    );
+}
+
+fn median(values: &mut [f64]) -> f64 {
+    values.sort_by(f64::total_cmp);
+    values[values.len() / 2]
+}
+
+/// User plus system CPU time of the whole process.
+#[cfg(target_os = "linux")]
+fn cpu_time() -> Option<Duration> {
+    let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return None;
+    }
+    let time = |time: libc::timeval| {
+        Duration::from_secs(time.tv_sec as u64) + Duration::from_micros(time.tv_usec as u64)
+    };
+    Some(time(usage.ru_utime) + time(usage.ru_stime))
+}
+
+#[cfg(not(target_os = "linux"))]
+fn cpu_time() -> Option<Duration> {
+    None
+}
+
+/// Resets the kernel's resident set high-water mark, so the next reading
+/// covers only what runs after this.
+fn reset_peak_memory() {
+    if cfg!(target_os = "linux") {
+        let _ = fs::write("/proc/self/clear_refs", "5");
+    }
+}
+
+fn peak_memory() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with("VmHWM:"))?;
+    let kilobytes: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kilobytes * 1024)
+}
+
+fn print_latency(root: &Path, engine: &str, threads: usize, latencies: &mut [Duration]) {
+    if latencies.is_empty() {
+        return;
+    }
+    latencies.sort_unstable();
+    let micros = |latency: Duration| latency.as_secs_f64() * 1e6;
+    let percentiles: Vec<_> = PERCENTILES
+        .iter()
+        .map(|(name, fraction)| {
+            let index = ((latencies.len() - 1) as f64 * fraction).round() as usize;
+            format!("\"{name}_us\":{:.1}", micros(latencies[index]))
+        })
+        .collect();
+    println!(
+        "{{\"event\":\"latency\",\"path\":{},\"engine\":{},\"threads\":{threads},\"samples\":{},{},\"max_us\":{:.1}}}",
+        json_string(&root.to_string_lossy()),
+        json_string(engine),
+        latencies.len(),
+        percentiles.join(","),
+        micros(latencies[latencies.len() - 1])
+    );
+}
+
+/// One `bench` line from a results file.
+struct Measured {
+    entries_per_second: f64,
+    spread: f64,
+    allocations: Option<f64>,
+    peak_memory: Option<f64>,
+}
+
+/// Compares the bench results in `current` against those in `baseline`,
+/// matching lines by path, engine and threads, and prints one line per
+/// match. Exits with status 1 if any throughput, allocation count or peak
+/// memory got worse by more than its tolerance, or if a baseline result
+/// is missing from the current run, since an engine that stopped running
+/// would otherwise pass unnoticed.
+pub fn compare(baseline: &Path, current: &Path) {
+    let baseline = read_results(baseline);
+    let current = read_results(current);
+
+    let mut missing: Vec<_> = baseline
+        .keys()
+        .filter(|key| !current.contains_key(*key))
+        .collect();
+    missing.sort();
+    for (path, engine, threads) in &missing {
+        println!("{path} {engine}/{threads}: missing from current run");
+    }
+
+    let mut keys: Vec<_> = current.keys().collect();
+    keys.sort();
+    let mut regressions = 0;
+    for key in keys {
+        let (path, engine, threads) = key;
+        let now = &current[key];
+        let Some(before) = baseline.get(key) else {
+            println!("{path} {engine}/{threads}: no baseline");
+            continue;
+        };
+
+        let mut verdicts = Vec::new();
+        let tolerance = MIN_THROUGHPUT_TOLERANCE.max(NOISE_FACTOR * before.spread.max(now.spread));
+        let throughput = now.entries_per_second / before.entries_per_second.max(1e-9) - 1.0;
+        verdicts.push((
+            format!(
+                "{:.0} -> {:.0} entries/s ({:+.1}%)",
+                before.entries_per_second,
+                now.entries_per_second,
+                throughput * 100.0
+            ),
+            throughput < -tolerance,
+        ));
+        for (name, before, now, tolerance) in [
+            (
+                "allocations",
+                before.allocations,
+                now.allocations,
+                ALLOCATION_TOLERANCE,
+            ),
+            (
+                "peak memory",
+                before.peak_memory,
+                now.peak_memory,
+                PEAK_MEMORY_TOLERANCE,
+            ),
+        ] {
+            if let (Some(before), Some(now)) = (before, now) {
+                let growth = now / before.max(1.0) - 1.0;
+                verdicts.push((
+                    format!("{name} {before:.0} -> {now:.0} ({:+.1}%)", growth * 100.0),
+                    growth > tolerance,
+                ));
+            }
+        }
+
+        let regressed = verdicts.iter().any(|(_, regressed)| *regressed);
+        regressions += regressed as usize;
+        let details: Vec<_> = verdicts
+            .into_iter()
+            .map(|(text, regressed)| {
+                if regressed {
+                    format!("{text} REGRESSION")
+                } else {
+                    text
+                }
+            })
+            .collect();
+        println!("{path} {engine}/{threads}: {}", details.join(", "));
+    }
+
+    if regressions > 0 {
+        eprintln!("dirsize: {regressions} benchmark regressions");
+    }
+    if !missing.is_empty() {
+        eprintln!(
+            "dirsize: {} baseline results missing from the current run",
+            missing.len()
+        );
+    }
+    if regressions > 0 || !missing.is_empty() {
+        process::exit(1);
+    }
+}
+
+fn read_results(path: &Path) -> HashMap<(String, String, u64), Measured> {
+    let text = fs::read_to_string(path).unwrap_or_else(|error| {
+        eprintln!("dirsize: cannot read {}: {error}", path.display());
+        process::exit(2);
+    });
+
+    let mut results = HashMap::new();
+    for line in text.lines() {
+        let Some(fields) = parse_object(line) else {
+            continue;
+        };
+        if fields.get("event").map(String::as_str) != Some("bench") {
+            continue;
+        }
+        let number = |name: &str| fields.get(name).and_then(|value| value.parse::<f64>().ok());
+        let (Some(path), Some(engine), Some(threads), Some(entries_per_second)) = (
+            fields.get("path"),
+            fields.get("engine"),
+            number("threads"),
+            number("entries_per_second"),
+        ) else {
+            continue;
+        };
+        results.insert(
+            (path.clone(), engine.clone(), threads as u64),
+            Measured {
+                entries_per_second,
+                spread: number("spread").unwrap_or(0.0),
+                allocations: number("allocations"),
+                peak_memory: number("peak_memory_bytes"),
+            },
+        );
+    }
+    results
+}
+
+/// Parses one flat JSON object of strings, numbers and nulls, as written
+/// by `bench`, into raw field values.
+fn parse_object(line: &str) -> Option<HashMap<String, String>> {
+    let mut chars = line.trim().strip_prefix('{')?.strip_suffix('}')?.chars();
+    let mut fields = HashMap::new();
+    loop {
+        let Some(quote) = chars.find(|c| !c.is_whitespace()) else {
+            return Some(fields);
+        };
+        if quote != '"' {
+            return None;
+        }
+        let name = parse_string(&mut chars)?;
+        chars.find(|&c| c == ':')?;
+
+        let mut value = String::new();
+        match chars.find(|c| !c.is_whitespace())? {
+            '"' => value = parse_string(&mut chars)?,
+            first => {
+                value.push(first);
+                for c in chars.by_ref() {
+                    if c == ',' {
+                        break;
+                    }
+                    value.push(c);
+                }
+                fields.insert(name, value.trim().to_owned());
+                continue;
+            }
+        }
+        fields.insert(name, value);
+        chars.find(|&c| c == ',');
+    }
+}
+
+fn parse_string(chars: &mut std::str::Chars) -> Option<String> {
+    let mut text = String::new();
+    loop {
+        match chars.next()? {
+            '"' => return Some(text),
+            '\\' => match chars.next()? {
+                'u' => {
+                    let code: String = chars.by_ref().take(4).collect();
+                    text.push(char::from_u32(u32::from_str_radix(&code, 16).ok()?)?);
+                }
+                escaped => text.push(escaped),
+            },
+            c => text.push(c),
+        }
+    }
+}
@@ -0,0 +1,148 @@
+use crate::listing;
+use std::cell::Cell;
+use std::collections::HashMap;
+use std::ffi::OsStr;
+use std::fs::{self, File};
+use std::os::fd::AsRawFd;
+use std::os::unix::ffi::OsStrExt;
+use std::path::Path;
+use std::sync::{OnceLock, RwLock};
+
+/// Entries whose `d_type` is checked against `lstat` when probing.
+const D_TYPE_SAMPLE: usize = 64;
+
+/// What one filesystem can be trusted with, probed when a directory on its
+/// device is listed and cached by `st_dev` once a probe has sampled at
+/// least one entry. Until then every directory on the device is probed.
+#[derive(Clone, Copy)]
+pub struct Capabilities {
+    pub fs_type: i64,
+    pub trust_d_type: bool,
+}
+
+fn cache() -> &'static RwLock<HashMap<u64, Capabilities>> {
+    static CACHE: OnceLock<RwLock<HashMap<u64, Capabilities>>> = OnceLock::new();
+    CACHE.get_or_init(|| RwLock::new(HashMap::new()))
+}
+
+thread_local! {
+    /// The last device this thread looked up. Scans mostly stay on one
+    /// device, so this spares them the shared lock on every directory.
+    static LAST: Cell<Option<(u64, Capabilities)>> = const { Cell::new(None) };
+}
+
+pub fn for_directory(device: u64, directory: &File, path: &Path) -> Capabilities {
+    if let Some((last, capabilities)) = LAST.get() {
+        if last == device {
+            return capabilities;
+        }
+    }
+    let cached = cache().read().unwrap().get(&device).copied();
+    let capabilities = match cached {
+        Some(capabilities) => capabilities,
+        None => {
+            let (capabilities, sampled) = probe(directory, path);
+            if sampled == 0 {
+                return capabilities;
+            }
+            *cache()
+                .write()
+                .unwrap()
+                .entry(device)
+                .or_insert(capabilities)
+        }
+    };
+    LAST.set(Some((device, capabilities)));
+    capabilities
+}
+
+/// Every device probed so far, for reporting.
+pub fn probed() -> Vec<(u64, Capabilities)> {
+    let mut probed: Vec<_> = cache()
+        .read()
+        .unwrap()
+        .iter()
+        .map(|(&device, &capabilities)| (device, capabilities))
+        .collect();
+    probed.sort_by_key(|&(device, _)| device);
+    probed
+}
+
+/// Probes the filesystem holding `directory`, returning what was found and
+/// how many entries the `d_type` check compared against `lstat`.
+fn probe(directory: &File, path: &Path) -> (Capabilities, usize) {
+    let mut statfs: libc::statfs = unsafe { std::mem::zeroed() };
+    // `f_type` is narrower than i64 on some targets.
+    #[allow(clippy::unnecessary_cast)]
+    let fs_type = if unsafe { libc::fstatfs(directory.as_raw_fd(), &mut statfs) } == 0 {
+        statfs.f_type as i64
+    } else {
+        0
+    };
+
+    // A second descriptor, so the caller's read position is left alone.
+    let mut sampled = 0;
+    let mut trust_d_type = true;
+    let listed = listing::open_directory(path).and_then(|sample| {
+        listing::for_each_record(&sample, |name, kind| {
+            if sampled < D_TYPE_SAMPLE && trust_d_type {
+                // An entry removed since it was read says nothing either way.
+                if let Ok(actual) = fs::symlink_metadata(path.join(OsStr::from_bytes(name))) {
+                    sampled += 1;
+                    trust_d_type = kind == d_type(&actual);
+                }
+            }
+        })
+    });
+
+    let capabilities = Capabilities {
+        fs_type,
+        trust_d_type: listed.is_ok() && trust_d_type,
+    };
+    (capabilities, sampled)
+}
+
+fn d_type(metadata: &fs::Metadata) -> u8 {
+    use std::os::unix::fs::FileTypeExt;
+
+    let file_type = metadata.file_type();
+    if file_type.is_dir() {
+        libc::DT_DIR
+    } else if file_type.is_file() {
+        libc::DT_REG
+    } else if file_type.is_symlink() {
+        libc::DT_LNK
+    } else if file_type.is_fifo() {
+        libc::DT_FIFO
+    } else if file_type.is_socket() {
+        libc::DT_SOCK
+    } else if file_type.is_char_device() {
+        libc::DT_CHR
+    } else if file_type.is_block_device() {
+        libc::DT_BLK
+    } else {
+        libc::DT_UNKNOWN
+    }
+}
+
+pub fn fs_type_name(fs_type: i64) -> String {
+    let name = match fs_type {
+        0xef53 => "ext2/3/4",
+        0x5846_5342 => "xfs",
+        0x9123_683e => "btrfs",
+        0x2fc1_2fc1 => "zfs",
+        0x0102_1994 => "tmpfs",
+        0x794c_7630 => "overlayfs",
+        0x6969 => "nfs",
+        0xff53_4d42 => "cifs",
+        0xfe53_4d42 => "smb2",
+        0x6573_5546 => "fuse",
+        0x4d44 => "vfat",
+        0x5346_544e => "ntfs",
+        0xf2f5_2010 => "f2fs",
+        0x9fa0 => "proc",
+        0x6265_6572 => "sysfs",
+        _ => return format!("{fs_type:#x}"),
+    };
+    name.to_owned()
+}
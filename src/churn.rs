@@ -0,0 +1,134 @@
+use crate::tree::{Changes, Tree};
+use crate::watch::json_string;
+use std::collections::HashMap;
+use std::time::{Duration, Instant};
+
+const HALF_LIFE: Duration = Duration::from_secs(600);
+
+/// A subtree is only reported on its own if no single child accounts for
+/// this share of its churn; otherwise the child is the better answer.
+const DOMINANT_CHILD: f64 = 0.9;
+
+/// Decayed create/delete/modify counts per directory. Events are buffered
+/// for a whole watch pass and folded into the counters in one batch.
+pub struct Churn {
+    batch: Vec<(usize, u64)>,
+    scores: HashMap<usize, (f64, Instant)>,
+}
+
+impl Churn {
+    pub fn new() -> Churn {
+        Churn {
+            batch: Vec::new(),
+            scores: HashMap::new(),
+        }
+    }
+
+    pub fn record(&mut self, index: usize, changes: &Changes) {
+        if changes.total() > 0 {
+            self.batch.push((index, changes.total()));
+        }
+    }
+
+    /// Applies the buffered events and returns whether there were any.
+    pub fn apply(&mut self, tree: &Tree) -> bool {
+        if self.batch.is_empty() {
+            return false;
+        }
+
+        let now = Instant::now();
+        for (mut index, count) in self.batch.drain(..) {
+            while tree.nodes[index].removed {
+                match tree.nodes[index].parent {
+                    Some(parent) => index = parent,
+                    None => break,
+                }
+            }
+            let (score, updated) = self.scores.entry(index).or_insert((0.0, now));
+            *score = decay(*score, *updated, now) + count as f64;
+            *updated = now;
+        }
+
+        self.scores.retain(|&index, (score, updated)| {
+            !tree.nodes[index].removed && decay(*score, *updated, now) >= 0.01
+        });
+        true
+    }
+
+    /// Follows the nodes to their new indices after `Tree::compact`.
+    pub fn renumber(&mut self, remap: &[Option<usize>]) {
+        self.batch = self
+            .batch
+            .drain(..)
+            .filter_map(|(index, count)| Some((remap[index]?, count)))
+            .collect();
+        self.scores = self
+            .scores
+            .drain()
+            .filter_map(|(index, score)| Some((remap[index]?, score)))
+            .collect();
+    }
+
+    /// The `count` directories with the most churn of their own.
+    pub fn hottest(&self, count: usize) -> Vec<usize> {
+        let mut hottest: Vec<_> = self.scores.iter().collect();
+        hottest.sort_by(|a, b| b.1 .0.total_cmp(&a.1 .0));
+        hottest
+            .into_iter()
+            .take(count)
+            .map(|(&index, _)| index)
+            .collect()
+    }
+
+    /// The `count` subtrees with the most churn, skipping ancestors whose
+    /// churn comes almost entirely from one child.
+    pub fn top(&self, tree: &Tree, count: usize) -> Vec<(usize, f64)> {
+        let now = Instant::now();
+        let mut subtree: HashMap<usize, f64> = HashMap::new();
+        for (&index, &(score, updated)) in &self.scores {
+            let score = decay(score, updated, now);
+            let mut current = Some(index);
+            while let Some(index) = current {
+                *subtree.entry(index).or_default() += score;
+                current = tree.nodes[index].parent;
+            }
+        }
+
+        let mut largest_child: HashMap<usize, f64> = HashMap::new();
+        for (&index, &score) in &subtree {
+            if let Some(parent) = tree.nodes[index].parent {
+                let largest = largest_child.entry(parent).or_default();
+                *largest = largest.max(score);
+            }
+        }
+
+        let mut top: Vec<_> = subtree
+            .into_iter()
+            .filter(|(index, score)| {
+                largest_child.get(index).copied().unwrap_or(0.0) < score * DOMINANT_CHILD
+            })
+            .collect();
+        top.sort_by(|a, b| b.1.total_cmp(&a.1));
+        top.truncate(count);
+        top
+    }
+
+    pub fn report(&self, tree: &Tree, count: usize) {
+        let top: Vec<_> = self
+            .top(tree, count)
+            .into_iter()
+            .map(|(index, score)| {
+                format!(
+                    "{{\"path\":{},\"score\":{score:.2}}}",
+                    json_string(&tree.nodes[index].path.to_string_lossy())
+                )
+            })
+            .collect();
+        println!("{{\"event\":\"churn\",\"top\":[{}]}}", top.join(","));
+    }
+}
+
+fn decay(score: f64, updated: Instant, now: Instant) -> f64 {
+    let elapsed = now.duration_since(updated).as_secs_f64();
+    score * 0.5f64.powf(elapsed / HALF_LIFE.as_secs_f64())
+}
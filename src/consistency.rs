@@ -0,0 +1,96 @@
+use crate::listing::{self, Listing};
+use rayon::prelude::*;
+use std::collections::HashSet;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+/// A directory that changed after the scan started, as it was listed.
+struct Volatile {
+    index: usize,
+    path: PathBuf,
+    size: u64,
+    subdirectories: Vec<PathBuf>,
+    /// Reached through a symlink, which its subdirectories inherit.
+    linked: bool,
+}
+
+/// Finds directories that changed while they were being listed, from an
+/// fstat of the open directory before and after the read. Their listing
+/// may mix states from before and after a change, so the totals they feed
+/// are not a consistent snapshot.
+pub struct Consistency {
+    volatile: Mutex<Vec<Volatile>>,
+}
+
+impl Consistency {
+    pub fn new() -> Consistency {
+        listing::check_changes();
+        Consistency {
+            volatile: Mutex::new(Vec::new()),
+        }
+    }
+
+    /// Checks `path` once `listing` has been read from it; `index` is the
+    /// top-level directory whose total it was added to, and `linked` says
+    /// whether `path` was reached through a symlink.
+    pub fn observe(&self, index: usize, path: &Path, linked: bool, listing: &Listing) {
+        if !listing.changed {
+            return;
+        }
+        self.volatile.lock().unwrap().push(Volatile {
+            index,
+            path: path.to_owned(),
+            size: listing.size,
+            subdirectories: listing.subdirectories.clone(),
+            linked,
+        });
+    }
+
+    /// Lists every volatile directory again and corrects `totals` for its
+    /// new size, scanning subdirectories that appeared with `scan`, which is
+    /// told whether each was reached through a symlink. Returns
+    /// how many directories could not be settled: ones that changed again
+    /// while being listed, vanished, or lost subdirectories whose bytes were
+    /// already counted.
+    pub fn rescan(&self, totals: &[AtomicU64], scan: impl Fn(usize, &Path, bool) + Sync) -> usize {
+        let volatile = std::mem::take(&mut *self.volatile.lock().unwrap());
+        volatile
+            .par_iter()
+            .filter(|volatile| {
+                let Ok(listing) = listing::list(&volatile.path) else {
+                    return true;
+                };
+                let total = &totals[volatile.index];
+                if listing.size >= volatile.size {
+                    total.fetch_add(listing.size - volatile.size, Ordering::Relaxed);
+                } else {
+                    total.fetch_sub(volatile.size - listing.size, Ordering::Relaxed);
+                }
+                let before: HashSet<&Path> = volatile
+                    .subdirectories
+                    .iter()
+                    .map(PathBuf::as_path)
+                    .collect();
+                let after: HashSet<&Path> = listing
+                    .subdirectories
+                    .iter()
+                    .map(PathBuf::as_path)
+                    .collect();
+                for (position, sub_path) in listing.subdirectories.iter().enumerate() {
+                    if !before.contains(sub_path.as_path()) {
+                        let linked = volatile.linked || listing.is_link(position);
+                        scan(volatile.index, sub_path, linked);
+                    }
+                }
+
+                let lost = before.iter().any(|sub_path| !after.contains(sub_path));
+                lost || listing.changed
+            })
+            .count()
+    }
+
+    pub fn volatile(&self) -> usize {
+        self.volatile.lock().unwrap().len()
+    }
+}
@@ -0,0 +1,295 @@
+use crate::consistency::Consistency;
+use crate::listing;
+use crate::memory;
+use crate::shape::Shape;
+use crate::throttle::Throttle;
+use std::collections::HashMap;
+use std::fs;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Condvar, Mutex};
+use std::thread;
+use std::time::Instant;
+
+/// Concurrent directory reads allowed per device, by kind of device.
+const ROTATIONAL_LIMIT: usize = 2;
+const SOLID_STATE_LIMIT: usize = 16;
+const OTHER_LIMIT: usize = 8;
+/// Directories queued across all devices beyond which, under memory
+/// pressure, a worker keeps walking its own device depth first instead of
+/// queueing more.
+const PRESSURE_QUEUE_LIMIT: usize = 4096;
+
+#[derive(Clone, Copy)]
+enum Kind {
+    Rotational,
+    SolidState,
+    Other,
+}
+
+impl Kind {
+    fn name(self) -> &'static str {
+        match self {
+            Kind::Rotational => "rotational",
+            Kind::SolidState => "solid-state",
+            Kind::Other => "other",
+        }
+    }
+
+    fn limit(self) -> usize {
+        match self {
+            Kind::Rotational => ROTATIONAL_LIMIT,
+            Kind::SolidState => SOLID_STATE_LIMIT,
+            Kind::Other => OTHER_LIMIT,
+        }
+    }
+}
+
+struct Device {
+    kind: Kind,
+    /// Root index, path and whether the path went through a symlink.
+    pending: Vec<(usize, PathBuf, bool)>,
+    active: usize,
+    directories: u64,
+    entries: u64,
+    first: Option<Instant>,
+    last: Option<Instant>,
+}
+
+struct Scheduler {
+    devices: HashMap<u64, Device>,
+    order: Vec<u64>,
+    next: usize,
+    active: usize,
+}
+
+impl Scheduler {
+    /// Queues `items` on `device` and returns how many of them a waiting
+    /// worker can take at once, given the device's free slots.
+    fn push(
+        &mut self,
+        device: u64,
+        items: impl IntoIterator<Item = (usize, PathBuf, bool)>,
+    ) -> usize {
+        let queue = self.devices.entry(device).or_insert_with(|| {
+            self.order.push(device);
+            Device {
+                kind: kind(device),
+                pending: Vec::new(),
+                active: 0,
+                directories: 0,
+                entries: 0,
+                first: None,
+                last: None,
+            }
+        });
+        let free = queue.kind.limit().saturating_sub(queue.active);
+        let before = queue.pending.len().min(free);
+        queue.pending.extend(items);
+        queue.pending.len().min(free) - before
+    }
+
+    /// Takes work from the next device, round robin, that has both pending
+    /// directories and a free slot under its limit.
+    fn take(&mut self) -> Option<(u64, (usize, PathBuf, bool))> {
+        for step in 0..self.order.len() {
+            let position = (self.next + step) % self.order.len();
+            let device = self.order[position];
+            let queue = self.devices.get_mut(&device).unwrap();
+            if queue.active < queue.kind.limit() {
+                if let Some(item) = queue.pending.pop() {
+                    queue.active += 1;
+                    self.active += 1;
+                    self.next = position + 1;
+                    return Some((device, item));
+                }
+            }
+        }
+        None
+    }
+
+    /// Frees a slot taken on `device` and returns whether a waiting worker
+    /// can use it.
+    fn release(&mut self, device: u64) -> bool {
+        let queue = self.devices.get_mut(&device).unwrap();
+        queue.active -= 1;
+        self.active -= 1;
+        !queue.pending.is_empty()
+    }
+
+    fn queued(&self) -> usize {
+        self.devices.values().map(|queue| queue.pending.len()).sum()
+    }
+
+    fn is_done(&self) -> bool {
+        self.active == 0 && self.devices.values().all(|queue| queue.pending.is_empty())
+    }
+}
+
+/// Finishes a scan with a queue and concurrency limit per `st_dev`, so a
+/// slow disk cannot hold every worker while other devices sit idle.
+/// Adds each directory's size to `totals` under its root index as it goes
+/// and prints per-device throughput to stderr at the end. Each pending
+/// directory comes with whether it was reached through a symlink.
+pub fn scan(
+    pending: Vec<(usize, PathBuf, bool)>,
+    totals: &[AtomicU64],
+    consistency: Option<&Consistency>,
+    throttle: Option<&Throttle>,
+    shape: Option<&Shape>,
+) {
+    let mut scheduler = Scheduler {
+        devices: HashMap::new(),
+        order: Vec::new(),
+        next: 0,
+        active: 0,
+    };
+    for (index, path, linked) in pending {
+        // A top-level directory removed since it was listed has nothing
+        // left to count.
+        let Ok(metadata) = fs::metadata(&path) else {
+            continue;
+        };
+        scheduler.push(listing::device(&metadata), [(index, path, linked)]);
+    }
+
+    let state = Mutex::new(scheduler);
+    let ready = Condvar::new();
+
+    thread::scope(|scope| {
+        for _ in 0..workers() {
+            scope.spawn(|| work(&state, &ready, totals, consistency, throttle, shape));
+        }
+    });
+
+    let scheduler = state.into_inner().unwrap();
+
+    for device in &scheduler.order {
+        let queue = &scheduler.devices[device];
+        let elapsed = match (queue.first, queue.last) {
+            (Some(first), Some(last)) => last.duration_since(first).as_secs_f64(),
+            _ => 0.0,
+        };
+        eprintln!(
+            "device {}: {} (limit {}): {} directories, {} entries, {:.0} entries/s",
+            device_name(*device),
+            queue.kind.name(),
+            queue.kind.limit(),
+            queue.directories,
+            queue.entries,
+            queue.entries as f64 / elapsed.max(1e-9)
+        );
+    }
+}
+
+/// Worker threads across all devices.
+pub fn workers() -> usize {
+    thread::available_parallelism().map_or(4, |count| count.get() * 2)
+}
+
+fn work(
+    state: &Mutex<Scheduler>,
+    ready: &Condvar,
+    totals: &[AtomicU64],
+    consistency: Option<&Consistency>,
+    throttle: Option<&Throttle>,
+    shape: Option<&Shape>,
+) {
+    let mut guard = state.lock().unwrap();
+    loop {
+        let Some((device, (index, path, linked))) = guard.take() else {
+            if guard.is_done() {
+                ready.notify_all();
+                return;
+            }
+            guard = ready.wait(guard).unwrap();
+            continue;
+        };
+        drop(guard);
+
+        let started = Instant::now();
+        let mut directories = 0;
+        let mut entries = 0;
+        let mut own = vec![(path, linked)];
+        while let Some((path, linked)) = own.pop() {
+            let listing = match throttle {
+                Some(throttle) => throttle.list(&path),
+                None => listing::list_or_size(&path),
+            };
+            if let Some(consistency) = consistency {
+                consistency.observe(index, &path, linked, &listing);
+            }
+            if let Some(shape) = shape {
+                shape.record(&path, &listing);
+            }
+            totals[index].fetch_add(listing.size, Ordering::Relaxed);
+            directories += 1;
+            entries += listing.entries;
+
+            // Subdirectories are queued on this directory's own device, from
+            // the fstat the listing already made, rather than stat'ing each
+            // one. Only a mount point is queued on the wrong device, and its
+            // own subdirectories go to the right one once it is listed.
+            let sub_device = listing.device;
+            let subdirectories = listing
+                .into_subdirectories()
+                .map(|(sub_path, is_link)| (sub_path, linked || is_link));
+            let mut scheduler = state.lock().unwrap();
+            if memory::under_pressure()
+                && scheduler.queued() >= PRESSURE_QUEUE_LIMIT
+                && sub_device == device
+            {
+                own.extend(subdirectories);
+            } else {
+                let takeable = scheduler.push(
+                    sub_device,
+                    subdirectories.map(|(sub_path, linked)| (index, sub_path, linked)),
+                );
+                for _ in 0..takeable {
+                    ready.notify_one();
+                }
+            }
+        }
+
+        guard = state.lock().unwrap();
+        let scheduler = &mut *guard;
+        let queue = scheduler.devices.get_mut(&device).unwrap();
+        queue.directories += directories;
+        queue.entries += entries;
+        queue.first = Some(queue.first.map_or(started, |first| first.min(started)));
+        queue.last = Some(Instant::now());
+        if scheduler.release(device) {
+            ready.notify_one();
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+pub fn device_name(device: u64) -> String {
+    format!("{}:{}", libc::major(device), libc::minor(device))
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn device_name(device: u64) -> String {
+    device.to_string()
+}
+
+/// Classifies a device from sysfs. Partitions keep their queue settings on
+/// the parent disk, and devices without a block queue (network and
+/// virtual filesystems) count as `Other`.
+#[cfg(target_os = "linux")]
+fn kind(device: u64) -> Kind {
+    let block = std::path::Path::new("/sys/dev/block").join(device_name(device));
+    let rotational = fs::read_to_string(block.join("queue/rotational"))
+        .or_else(|_| fs::read_to_string(block.join("../queue/rotational")));
+    match rotational.as_deref().map(str::trim) {
+        Ok("1") => Kind::Rotational,
+        Ok(_) => Kind::SolidState,
+        Err(_) => Kind::Other,
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn kind(_device: u64) -> Kind {
+    Kind::Other
+}
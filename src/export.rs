@@ -0,0 +1,734 @@
+use crate::arrow::{self, Column, Message, Type};
+use crate::index::{self, Entry, Index};
+use crate::listing::{self, Listing};
+use crate::memory;
+use rayon::prelude::*;
+use std::cell::RefCell;
+use std::collections::{HashMap, HashSet};
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufReader, BufWriter, Read, Seek, SeekFrom, Write};
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc::{self, SyncSender};
+use std::thread;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+const BATCH_ROWS: usize = 64 * 1024;
+/// Batch size while memory is tight, to keep every thread's buffer small.
+const PRESSURE_BATCH_ROWS: usize = 4 * 1024;
+const BATCHES_IN_FLIGHT: usize = 8;
+
+/// One row per directory. Paths are prefix-encoded: each row carries only
+/// its own name plus the id of its parent row, and the root row holds the
+/// scanned path and is its own parent. `modified` is in seconds since the
+/// epoch, zero when unknown.
+const FIELDS: [(&str, Type); 7] = [
+    ("id", Type::UInt64),
+    ("parent", Type::UInt64),
+    ("name", Type::Utf8),
+    ("size", Type::UInt64),
+    ("entries", Type::UInt64),
+    ("total_size", Type::UInt64),
+    ("modified", Type::UInt64),
+];
+
+struct Batch {
+    ids: Vec<u64>,
+    parents: Vec<u64>,
+    name_offsets: Vec<i32>,
+    names: Vec<u8>,
+    sizes: Vec<u64>,
+    entries: Vec<u64>,
+    total_sizes: Vec<u64>,
+    modified: Vec<u64>,
+}
+
+impl Default for Batch {
+    fn default() -> Batch {
+        Batch {
+            ids: Vec::new(),
+            parents: Vec::new(),
+            name_offsets: vec![0],
+            names: Vec::new(),
+            sizes: Vec::new(),
+            entries: Vec::new(),
+            total_sizes: Vec::new(),
+            modified: Vec::new(),
+        }
+    }
+}
+
+impl Batch {
+    fn len(&self) -> usize {
+        self.ids.len()
+    }
+
+    #[allow(clippy::too_many_arguments)]
+    fn push(
+        &mut self,
+        id: u64,
+        parent: u64,
+        name: &[u8],
+        size: u64,
+        entries: u64,
+        total_size: u64,
+        modified: u64,
+    ) {
+        self.ids.push(id);
+        self.parents.push(parent);
+        self.names.extend_from_slice(name);
+        self.name_offsets.push(self.names.len() as i32);
+        self.sizes.push(size);
+        self.entries.push(entries);
+        self.total_sizes.push(total_size);
+        self.modified.push(modified);
+    }
+
+    fn name(&self, row: usize) -> &[u8] {
+        &self.names[self.name_offsets[row] as usize..self.name_offsets[row + 1] as usize]
+    }
+
+    /// The batch's rows as the index needs them, with the batch written at
+    /// offset `start` of the snapshot.
+    fn index_rows(&self, start: u64) -> impl Iterator<Item = index::Row> + '_ {
+        (0..self.len()).map(move |row| index::Row {
+            id: self.ids[row],
+            parent: self.parents[row],
+            name: String::from_utf8_lossy(self.name(row)).into_owned(),
+            total_size: self.total_sizes[row],
+            modified: self.modified[row],
+            batch: start,
+        })
+    }
+
+    fn into_columns(self) -> [Column; 7] {
+        [
+            Column::UInt64(self.ids),
+            Column::UInt64(self.parents),
+            Column::Utf8 {
+                offsets: self.name_offsets,
+                data: self.names,
+            },
+            Column::UInt64(self.sizes),
+            Column::UInt64(self.entries),
+            Column::UInt64(self.total_sizes),
+            Column::UInt64(self.modified),
+        ]
+    }
+
+    fn from_columns(columns: Vec<Column>) -> Option<Batch> {
+        let Ok(
+            [Column::UInt64(ids), Column::UInt64(parents), Column::Utf8 { offsets, data }, Column::UInt64(sizes), Column::UInt64(entries), Column::UInt64(total_sizes), Column::UInt64(modified)],
+        ) = <[Column; 7]>::try_from(columns)
+        else {
+            return None;
+        };
+        Some(Batch {
+            ids,
+            parents,
+            name_offsets: offsets,
+            names: data,
+            sizes,
+            entries,
+            total_sizes,
+            modified,
+        })
+    }
+}
+
+/// Seconds since the epoch, zero when unknown.
+fn epoch_seconds(modified: Option<SystemTime>) -> u64 {
+    modified
+        .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok())
+        .map_or(0, |since| since.as_secs())
+}
+
+thread_local! {
+    static BATCH: RefCell<Batch> = RefCell::new(Batch::default());
+}
+
+struct Exporter {
+    next_id: AtomicU64,
+    batches: SyncSender<Batch>,
+    /// Set once the writer has hung up after an error, so that the scan
+    /// stops instead of listing directories nobody will write.
+    failed: AtomicBool,
+}
+
+impl Exporter {
+    fn new(first_id: u64, batches: SyncSender<Batch>) -> Exporter {
+        Exporter {
+            next_id: AtomicU64::new(first_id),
+            batches,
+            failed: AtomicBool::new(false),
+        }
+    }
+
+    fn send(&self, batch: Batch) {
+        if self.batches.send(batch).is_err() {
+            self.failed.store(true, Ordering::Relaxed);
+        }
+    }
+
+    /// Appends a row to the calling thread's batch and hands the batch to
+    /// the writer once it is full, so workers never contend on output.
+    fn push(&self, id: u64, parent: u64, name: &str, listing: &Listing, total_size: u64) {
+        let full = BATCH.with(|batch| {
+            let mut batch = batch.borrow_mut();
+            batch.push(
+                id,
+                parent,
+                name.as_bytes(),
+                listing.size,
+                listing.entries,
+                total_size,
+                epoch_seconds(listing.modified),
+            );
+            let full = batch.len() >= BATCH_ROWS
+                || (batch.len() >= PRESSURE_BATCH_ROWS && memory::under_pressure());
+            full.then(|| std::mem::take(&mut *batch))
+        });
+        if let Some(batch) = full {
+            self.send(batch);
+        }
+    }
+
+    fn flush(&self) {
+        let batch = BATCH.with(|batch| std::mem::take(&mut *batch.borrow_mut()));
+        if batch.len() > 0 {
+            self.send(batch);
+        }
+    }
+
+    fn export_directory(&self, path: &Path, parent: u64) -> u64 {
+        if self.failed.load(Ordering::Relaxed) {
+            return 0;
+        }
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let listing = listing::list_or_size(path);
+        let subtree = |sub_path: &PathBuf| self.export_directory(sub_path, id);
+        let total_size = listing.size
+            + if memory::under_pressure() {
+                listing.subdirectories.iter().map(subtree).sum::<u64>()
+            } else {
+                listing.subdirectories.par_iter().map(subtree).sum::<u64>()
+            };
+
+        let name = path.file_name().unwrap_or_default().to_string_lossy();
+        self.push(id, parent, &name, &listing, total_size);
+        total_size
+    }
+
+    /// Exports the subdirectories in `listing` under `parent`, returning
+    /// their combined total.
+    fn export_children(&self, listing: &Listing, parent: u64) -> u64 {
+        listing
+            .subdirectories
+            .par_iter()
+            .map(|path| self.export_directory(path, parent))
+            .sum()
+    }
+
+    /// Hands every thread's partial batch to the writer.
+    fn flush_all(&self) {
+        rayon::broadcast(|_| self.flush());
+        self.flush();
+    }
+}
+
+fn index_path(output: &Path) -> PathBuf {
+    let mut index_path = output.as_os_str().to_owned();
+    index_path.push(".index");
+    PathBuf::from(index_path)
+}
+
+fn fail(message: String) -> ! {
+    eprintln!("dirsize: {message}");
+    process::exit(1);
+}
+
+/// Scans `root` and writes every directory as an Arrow IPC stream to
+/// `output` (`-` for stdout). Returns the same per-directory totals as a
+/// plain scan. With `with_index`, also writes secondary indexes over the
+/// rows to `output` plus `.index`. A write error, a closed pipe included,
+/// stops the scan and exits.
+pub fn scan(root: &Path, output: &Path, with_index: bool) -> Vec<(String, u64)> {
+    let cannot_write = |error: io::Error| -> ! {
+        if output == Path::new("-") {
+            fail(format!("cannot write to stdout: {error}"))
+        }
+        fail(format!("cannot write {}: {error}", output.display()))
+    };
+    let out: Box<dyn Write + Send> = if output == Path::new("-") {
+        Box::new(io::stdout())
+    } else {
+        Box::new(File::create(output).unwrap_or_else(|error| cannot_write(error)))
+    };
+    let (sender, receiver) = mpsc::sync_channel::<Batch>(BATCHES_IN_FLIGHT);
+    let writer = thread::spawn(move || -> io::Result<(Option<Vec<index::Row>>, u64)> {
+        let mut out = BufWriter::new(out);
+        let mut rows = with_index.then(Vec::new);
+        let mut position = arrow::write_schema(&mut out, &FIELDS)?;
+        for batch in receiver {
+            if let Some(rows) = &mut rows {
+                rows.extend(batch.index_rows(position));
+            }
+            let length = batch.len();
+            position += arrow::write_batch(&mut out, length, &batch.into_columns())?;
+        }
+        arrow::write_end(&mut out)?;
+        out.flush()?;
+        Ok((rows, position + arrow::END.len() as u64))
+    });
+
+    let exporter = Exporter::new(1, sender);
+    let listing = listing::list(root).unwrap();
+    let directory_sizes: Vec<_> = listing
+        .subdirectories
+        .par_iter()
+        .map(|path| {
+            let size = exporter.export_directory(path, 0);
+            (path.to_str().unwrap().to_owned(), size)
+        })
+        .collect();
+
+    let total_size = listing.size + directory_sizes.iter().map(|(_, size)| size).sum::<u64>();
+    // The root is stored canonical so queries can name it however they
+    // like; see `index::query`.
+    let name = fs::canonicalize(root).unwrap_or_else(|_| root.to_owned());
+    exporter.push(0, 0, &name.to_string_lossy(), &listing, total_size);
+    exporter.flush_all();
+    drop(exporter);
+    let (rows, length) = writer
+        .join()
+        .unwrap()
+        .unwrap_or_else(|error| cannot_write(error));
+    if let Some(rows) = rows {
+        let index_path = index_path(output);
+        index::write(&index_path, rows, length).unwrap_or_else(|error| {
+            fail(format!("cannot write {}: {error}", index_path.display()))
+        });
+    }
+
+    directory_sizes
+}
+
+/// A record batch of a saved snapshot and where its message starts in the file.
+struct Stored {
+    start: u64,
+    batch: Batch,
+}
+
+fn read_snapshot(path: &Path) -> io::Result<Vec<Stored>> {
+    let mut input = BufReader::new(File::open(path)?);
+    let mut position = 0;
+    let mut stored = Vec::new();
+    while let Some((message, length)) = arrow::read_message(&mut input, &FIELDS)? {
+        if let Message::Batch(columns) = message {
+            let batch = Batch::from_columns(columns).ok_or_else(|| {
+                io::Error::new(io::ErrorKind::InvalidData, "not a dirsize snapshot")
+            })?;
+            stored.push(Stored {
+                start: position,
+                batch,
+            });
+        }
+        position += length;
+    }
+    Ok(stored)
+}
+
+/// The rows a refresh touches: the target directory's, every one below it
+/// and every one above it, plus an id above every row's.
+struct Subtree {
+    target: Entry,
+    below: Vec<Entry>,
+    ancestors: Vec<Entry>,
+    next_id: u64,
+}
+
+/// Finds `directory` in `snapshot` by reading all of it, for when there is
+/// no index to find it with.
+fn locate(snapshot: &Path, directory: &Path) -> Option<Subtree> {
+    let stored = read_snapshot(snapshot)
+        .unwrap_or_else(|error| fail(format!("cannot read {}: {error}", snapshot.display())));
+
+    let mut rows = HashMap::new();
+    let mut children: HashMap<u64, Vec<u64>> = HashMap::new();
+    for (batch_index, stored) in stored.iter().enumerate() {
+        for (row, (&id, &parent)) in stored
+            .batch
+            .ids
+            .iter()
+            .zip(&stored.batch.parents)
+            .enumerate()
+        {
+            rows.insert(id, (batch_index, row));
+            if id != 0 {
+                children.entry(parent).or_default().push(id);
+            }
+        }
+    }
+    let row = |id: u64| {
+        let (batch, row) = rows[&id];
+        (&stored[batch].batch, row)
+    };
+    let entry = |id: u64| {
+        let (batch, row) = rows[&id];
+        Entry {
+            record: 0,
+            id,
+            batch: stored[batch].start,
+            total_size: stored[batch].batch.total_sizes[row],
+        }
+    };
+    if !rows.contains_key(&0) {
+        fail(format!("{} has no root row", snapshot.display()));
+    }
+    // Snapshots written before roots were canonicalized hold the root as
+    // it was typed.
+    let (root_batch, root_row) = row(0);
+    let root = PathBuf::from(String::from_utf8_lossy(root_batch.name(root_row)).into_owned());
+    let root = fs::canonicalize(&root).unwrap_or(root);
+
+    let relative = directory.strip_prefix(&root).ok()?;
+    let target = relative.components().try_fold(0, |id, component| {
+        let name = component.as_os_str().as_encoded_bytes();
+        children.get(&id)?.iter().copied().find(|&child| {
+            let (batch, row) = row(child);
+            batch.name(row) == name
+        })
+    })?;
+
+    let mut below = Vec::new();
+    let mut stack = children.get(&target).cloned().unwrap_or_default();
+    while let Some(id) = stack.pop() {
+        below.push(entry(id));
+        stack.extend(children.get(&id).into_iter().flatten());
+    }
+    let mut ancestors = Vec::new();
+    let mut current = target;
+    while current != 0 {
+        current = row(current).0.parents[row(current).1];
+        ancestors.push(entry(current));
+    }
+    Some(Subtree {
+        target: entry(target),
+        below,
+        ancestors,
+        next_id: rows.keys().max().unwrap() + 1,
+    })
+}
+
+/// Rescans the directory at `path` inside the saved `snapshot`, replacing
+/// its subtree's rows and adjusting its ancestors' totals in place: the
+/// record batches holding any of those rows are re-encoded where they sit,
+/// and the new subtree's rows are appended as batches of their own with
+/// ids above every existing one. An index beside the snapshot finds those
+/// rows without reading the rest and is patched in turn; see
+/// `index::patch`. Prints the directory's new total.
+pub fn refresh(snapshot: &Path, path: &Path) {
+    // A directory that has gone is refreshed too, by dropping it, so only
+    // its parent has to exist.
+    let absolute = fs::canonicalize(path).or_else(|error| {
+        let parent = path
+            .parent()
+            .filter(|parent| !parent.as_os_str().is_empty());
+        let parent = fs::canonicalize(parent.unwrap_or(Path::new(".")))?;
+        Ok::<_, io::Error>(parent.join(path.file_name().ok_or(error)?))
+    });
+    let Ok(directory) = absolute else {
+        fail(format!("{} is not in the snapshot", path.display()));
+    };
+    let length = fs::metadata(snapshot)
+        .unwrap_or_else(|error| fail(format!("cannot read {}: {error}", snapshot.display())))
+        .len();
+
+    // Only an index written for the snapshot as it is now can be trusted
+    // to find the rows.
+    let index_path = index_path(snapshot);
+    let index = Index::open(&index_path)
+        .ok()
+        .filter(|index| index.snapshot_length() == length);
+    let found = index.as_ref().and_then(|index| {
+        let target = index.find(directory.to_str()?)?;
+        Some(Subtree {
+            below: index.descendants(&target),
+            ancestors: index.ancestors(&target),
+            next_id: index.next_id(),
+            target,
+        })
+    });
+    let index = index.filter(|_| found.is_some());
+    let Some(Subtree {
+        target,
+        mut below,
+        ancestors,
+        next_id,
+    }) = found.or_else(|| locate(snapshot, &directory))
+    else {
+        fail(format!("{} is not in the snapshot", path.display()));
+    };
+
+    // The rescan is exported as a fresh scan is, into batches of its own.
+    let exists = directory.is_dir();
+    if !exists && target.id == 0 {
+        fail(format!("{} no longer exists", directory.display()));
+    }
+    let listing = listing::list_or_size(&directory);
+    let (sender, receiver) = mpsc::sync_channel::<Batch>(BATCHES_IN_FLIGHT);
+    let collector = thread::spawn(move || receiver.into_iter().collect::<Vec<_>>());
+    let exporter = Exporter::new(next_id, sender);
+    let total_size = if exists {
+        listing.size + exporter.export_children(&listing, target.id)
+    } else {
+        below.push(target);
+        0
+    };
+    exporter.flush_all();
+    drop(exporter);
+    let added = collector.join().unwrap();
+
+    let delta = total_size as i64 - target.total_size as i64;
+    let modified = epoch_seconds(listing.modified);
+    let removed: HashSet<u64> = below.iter().map(|entry| entry.id).collect();
+    let raised: HashSet<u64> = ancestors.iter().map(|entry| entry.id).collect();
+    let mut affected: Vec<u64> = below
+        .iter()
+        .chain(&ancestors)
+        .chain([&target])
+        .map(|entry| entry.batch)
+        .collect();
+    affected.sort_unstable();
+    affected.dedup();
+    let patched = patch_snapshot(snapshot, &affected, added, |batch| {
+        let mut rewritten = Batch::default();
+        for row in 0..batch.len() {
+            let id = batch.ids[row];
+            if removed.contains(&id) {
+                continue;
+            }
+            let mut total = batch.total_sizes[row];
+            if raised.contains(&id) {
+                total = total.saturating_add_signed(delta);
+            }
+            let (size, entries, modified) = if id == target.id {
+                total = total_size;
+                (listing.size, listing.entries, modified)
+            } else {
+                (batch.sizes[row], batch.entries[row], batch.modified[row])
+            };
+            rewritten.push(
+                id,
+                batch.parents[row],
+                batch.name(row),
+                size,
+                entries,
+                total,
+                modified,
+            );
+        }
+        rewritten
+    });
+    let (added, length) = patched
+        .unwrap_or_else(|error| fail(format!("cannot write {}: {error}", snapshot.display())));
+
+    let patched = match index {
+        Some(index) => {
+            let change = index::Change {
+                target,
+                removed: below,
+                ancestors,
+                delta,
+                target_row: exists.then_some((total_size, modified)),
+                added,
+                snapshot_length: length,
+            };
+            index::patch(&index_path, &index, change)
+        }
+        None => Ok(!index_path.exists()),
+    };
+    let written = patched.and_then(|patched| match patched {
+        true => Ok(()),
+        false => rebuild_index(snapshot, &index_path),
+    });
+    written.unwrap_or_else(|error| fail(format!("cannot write {}: {error}", index_path.display())));
+    if exists {
+        println!("{}: {total_size} bytes", directory.display());
+    } else {
+        println!("{}: removed", directory.display());
+    }
+}
+
+/// Re-encodes the record batches starting at the offsets in `affected`
+/// through `rewrite`, each padded to the bytes it took, and appends `added`
+/// at the end of the stream. Returns the appended rows as the index needs
+/// them and the snapshot's new length.
+fn patch_snapshot(
+    snapshot: &Path,
+    affected: &[u64],
+    added: Vec<Batch>,
+    rewrite: impl Fn(&Batch) -> Batch,
+) -> io::Result<(Vec<index::Row>, u64)> {
+    let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not a dirsize snapshot");
+    let mut file = OpenOptions::new().read(true).write(true).open(snapshot)?;
+    for &start in affected {
+        file.seek(SeekFrom::Start(start))?;
+        let message = arrow::read_message(&mut BufReader::new(&mut file), &FIELDS)?;
+        let Some((Message::Batch(columns), length)) = message else {
+            return Err(invalid());
+        };
+        let batch = rewrite(&Batch::from_columns(columns).ok_or_else(invalid)?);
+        let mut bytes = Vec::new();
+        let rows = batch.len();
+        arrow::rewrite_batch(&mut bytes, rows, &batch.into_columns(), length)?;
+        file.seek(SeekFrom::Start(start))?;
+        file.write_all(&bytes)?;
+    }
+
+    let mut end = [0; 8];
+    let mut position = file.seek(SeekFrom::End(-(end.len() as i64)))?;
+    file.read_exact(&mut end)?;
+    if end != arrow::END {
+        return Err(invalid());
+    }
+    file.seek(SeekFrom::Start(position))?;
+    let mut out = BufWriter::new(&mut file);
+    let mut rows = Vec::new();
+    for batch in added {
+        rows.extend(batch.index_rows(position));
+        let length = batch.len();
+        position += arrow::write_batch(&mut out, length, &batch.into_columns())?;
+    }
+    arrow::write_end(&mut out)?;
+    out.into_inner()?.sync_all()?;
+    Ok((rows, position + arrow::END.len() as u64))
+}
+
+/// Writes the index beside `snapshot` from scratch.
+fn rebuild_index(snapshot: &Path, index_path: &Path) -> io::Result<()> {
+    let stored = read_snapshot(snapshot)?;
+    let rows = stored
+        .iter()
+        .flat_map(|stored| stored.batch.index_rows(stored.start))
+        .collect();
+    index::write(index_path, rows, fs::metadata(snapshot)?.len())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::collections::BTreeMap;
+    use std::sync::Mutex;
+
+    /// Exports share rayon's threads and the batches they hold, so they
+    /// must not overlap.
+    static EXPORTS: Mutex<()> = Mutex::new(());
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let path = std::env::temp_dir().join(format!("dirsize-{name}-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&path);
+        fs::create_dir_all(&path).unwrap();
+        fs::canonicalize(path).unwrap()
+    }
+
+    /// A file in every directory of `a/b/c` and of forty leaves under `d`.
+    fn tree(root: &Path) {
+        let mut directories = vec!["a".to_owned(), "a/b".to_owned(), "a/b/c".to_owned()];
+        directories.extend((0..40).map(|leaf| format!("d/{leaf}")));
+        for (size, directory) in directories.iter().enumerate() {
+            fs::create_dir_all(root.join(directory)).unwrap();
+            fs::write(root.join(directory).join("file"), vec![0; size * 1000]).unwrap();
+        }
+    }
+
+    /// The size, entries and total of every row in the snapshot at `path`,
+    /// by the row's path below the root.
+    fn rows(path: &Path) -> BTreeMap<String, (u64, u64, u64)> {
+        let stored = read_snapshot(path).unwrap();
+        let mut rows = HashMap::new();
+        for stored in &stored {
+            for row in 0..stored.batch.len() {
+                rows.insert(stored.batch.ids[row], (&stored.batch, row));
+            }
+        }
+        let path = |mut id: u64| {
+            let mut names = Vec::new();
+            while id != 0 {
+                let (batch, row) = rows[&id];
+                names.push(String::from_utf8_lossy(batch.name(row)).into_owned());
+                id = batch.parents[row];
+            }
+            names.reverse();
+            names.join("/")
+        };
+        rows.iter()
+            .map(|(&id, &(batch, row))| {
+                let values = (batch.sizes[row], batch.entries[row], batch.total_sizes[row]);
+                (path(id), values)
+            })
+            .collect()
+    }
+
+    #[test]
+    fn snapshot_reads_back() {
+        let _exports = EXPORTS
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner());
+        let root = scratch("snapshot");
+        let tree_root = root.join("tree");
+        tree(&tree_root);
+        let output = root.join("tree.arrow");
+        let totals = scan(&tree_root, &output, false);
+
+        let rows = rows(&output);
+        assert_eq!(rows.len(), 45);
+        assert_eq!(rows["d"].1, 40);
+        assert_eq!(rows["a"].2, rows["a"].0 + rows["a/b"].2);
+        for (path, total) in &totals {
+            let relative = Path::new(path).strip_prefix(&tree_root).unwrap();
+            assert_eq!(rows[relative.to_str().unwrap()].2, *total);
+        }
+        let below: u64 = totals.iter().map(|(_, total)| total).sum();
+        assert_eq!(rows[""].2, rows[""].0 + below);
+        fs::remove_dir_all(root).unwrap();
+    }
+
+    #[test]
+    fn refresh_matches_a_fresh_export() {
+        let _exports = EXPORTS
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner());
+        let root = scratch("refresh");
+        let tree_root = root.join("tree");
+        tree(&tree_root);
+        let output = root.join("tree.arrow");
+        scan(&tree_root, &output, true);
+
+        fs::remove_dir_all(tree_root.join("a/b/c")).unwrap();
+        fs::create_dir_all(tree_root.join("a/b/new/deeper")).unwrap();
+        fs::write(tree_root.join("a/b/new/deeper/file"), vec![0; 5000]).unwrap();
+        refresh(&output, &tree_root.join("a/b"));
+        let fresh = root.join("fresh.arrow");
+        scan(&tree_root, &fresh, true);
+        assert_eq!(rows(&output), rows(&fresh));
+
+        let (patched, rebuilt) = (index_path(&output), index_path(&fresh));
+        // The patched index still holds the dead record and its own
+        // orders, which a rebuilt one would have dropped.
+        assert!(fs::metadata(&patched).unwrap().len() > fs::metadata(&rebuilt).unwrap().len());
+        let (patched, rebuilt) = (
+            Index::open(&patched).unwrap(),
+            Index::open(&rebuilt).unwrap(),
+        );
+        for directory in ["", "a", "a/b", "a/b/c", "a/b/new", "a/b/new/deeper", "d/7"] {
+            let directory = tree_root.join(directory);
+            let directory = directory.to_str().unwrap();
+            let total = |index: &Index| index.find(directory).map(|entry| entry.total_size);
+            assert_eq!(total(&patched), total(&rebuilt), "{directory}");
+        }
+        fs::remove_dir_all(root).unwrap();
+    }
+}
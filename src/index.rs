@@ -0,0 +1,752 @@
+//! Secondary indexes over an Arrow snapshot, written beside it as
+//! `SNAPSHOT.index` when the export finishes. The Arrow stream holds rows
+//! in the order directories finished, which only supports linear scans, so
+//! the index repeats what queries need in one record per directory and
+//! adds:
+//!
+//! * an open-addressing table from a hash of each directory's path to its
+//!   record, for O(1) lookups by path;
+//! * records ordered by total size, largest first;
+//! * records ordered by modification time, oldest first.
+//!
+//! Records also link to their parent, first child and next sibling and hold
+//! the offset of the record batch with their row, so `dirsize refresh` can
+//! find a subtree, its ancestors and the batches to patch without reading
+//! the snapshot. It then patches the index in place: removed directories'
+//! records are marked dead, changed ones are updated and marked moved, new
+//! ones are appended, and the moved and new records get small orders of
+//! their own, which queries merge with the full ones. Once those orders,
+//! the table or the dead records grow past a fraction of the index, the
+//! refresh rebuilds it instead.
+//!
+//! Everything is little-endian 64-bit words after a nine-word header, so
+//! `dirsize query` maps the file and reads it in place.
+
+use crate::options::Query;
+use rayon::prelude::*;
+use std::cmp::Reverse;
+use std::collections::{HashMap, HashSet};
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufWriter, Seek, SeekFrom, Write};
+use std::path::Path;
+use std::process;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+const MAGIC: u64 = u64::from_le_bytes(*b"DIRSIDX2");
+
+// Header words. The full orders follow the table and hold `BASE_LENGTH`
+// records each; the refreshed ones start at word `DELTA`.
+const SLOTS: usize = 1;
+const USED: usize = 2;
+const BASE_LENGTH: usize = 3;
+const DELTA: usize = 4;
+const DELTA_LENGTH: usize = 5;
+const NEXT_ID: usize = 6;
+const GARBAGE: usize = 7;
+const SNAPSHOT_LENGTH: usize = 8;
+const HEADER_WORDS: usize = 9;
+
+// Record words, followed by the name padded to a whole word. Records are
+// addressed by their offset in words, so zero links to none, and the root
+// is its own parent.
+const ID: usize = 0;
+const PARENT: usize = 1;
+const TOTAL_SIZE: usize = 2;
+const MODIFIED: usize = 3;
+const FLAGS: usize = 4;
+const BATCH: usize = 5;
+const FIRST_CHILD: usize = 6;
+const NEXT_SIBLING: usize = 7;
+const NAME_LENGTH: usize = 8;
+const RECORD_WORDS: usize = 9;
+
+/// The directory is gone, and so is everything below it.
+const DEAD: u64 = 1;
+/// The record changed since the full orders were written, so only the
+/// refreshed orders place it.
+const MOVED: u64 = 2;
+
+/// One snapshot row as the index needs it. `modified` is in seconds since
+/// the epoch, zero when unknown, and `batch` is the offset in the snapshot
+/// of the record batch holding the row.
+pub struct Row {
+    pub id: u64,
+    pub parent: u64,
+    pub name: String,
+    pub total_size: u64,
+    pub modified: u64,
+    pub batch: u64,
+}
+
+/// FNV-1a, which can be continued from a parent's hash, so each path's hash
+/// costs only its last component while building.
+fn hash(mut state: u64, bytes: &[u8]) -> u64 {
+    for &byte in bytes {
+        state ^= byte as u64;
+        state = state.wrapping_mul(0x0000_0100_0000_01b3);
+    }
+    state
+}
+
+const HASH_BASIS: u64 = 0xcbf2_9ce4_8422_2325;
+
+/// Paths are hashed and compared without trailing slashes, so that `/` and
+/// `/home/` find the same rows as `` and `/home`.
+fn path_key(path: &str) -> u64 {
+    hash(HASH_BASIS, path.trim_end_matches('/').as_bytes())
+}
+
+fn invalid() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, "snapshot ids are inconsistent")
+}
+
+/// Writes the index for `rows`, given in any order, with the root as id 0
+/// and every parent's id below its children's, over a snapshot of
+/// `snapshot_length` bytes. Ids need not be dense, since a refreshed
+/// snapshot has gaps where a subtree was replaced.
+pub fn write(path: &Path, mut rows: Vec<Row>, snapshot_length: u64) -> io::Result<()> {
+    rows.par_sort_unstable_by_key(|row| row.id);
+    if rows.first().is_none_or(|root| root.id != 0)
+        || rows.windows(2).any(|pair| pair[0].id == pair[1].id)
+    {
+        return Err(invalid());
+    }
+    let position = |id: u64| rows.binary_search_by_key(&id, |row| row.id).ok();
+    let parents = rows
+        .iter()
+        .enumerate()
+        .map(|(index, row)| match position(row.parent) {
+            Some(parent) if parent < index || index == 0 => Ok(parent),
+            _ => Err(invalid()),
+        })
+        .collect::<io::Result<Vec<_>>>()?;
+
+    // The table takes twice the rows, so refreshes can add as many again
+    // before it has to be rebuilt.
+    let slots = (rows.len() * 4).next_power_of_two();
+    let mut records = Vec::with_capacity(rows.len());
+    let mut end = HEADER_WORDS + slots * 2 + rows.len() * 2;
+    for row in &rows {
+        records.push(end as u64);
+        end += record_words(&row.name);
+    }
+    let mut first_child = vec![0; rows.len()];
+    let mut next_sibling = vec![0; rows.len()];
+    for index in (1..rows.len()).rev() {
+        next_sibling[index] = first_child[parents[index]];
+        first_child[parents[index]] = records[index];
+    }
+
+    let mut hashes = Vec::with_capacity(rows.len());
+    for (row, &parent) in rows.iter().zip(&parents) {
+        hashes.push(match row.id {
+            0 => path_key(&row.name),
+            _ => hash(hashes[parent], format!("/{}", row.name).as_bytes()),
+        });
+    }
+    let mut table = vec![(0, 0); slots];
+    for (&key, &record) in hashes.iter().zip(&records) {
+        let mut slot = key as usize & (slots - 1);
+        while table[slot].1 != 0 {
+            slot = (slot + 1) & (slots - 1);
+        }
+        table[slot] = (key, record);
+    }
+
+    let mut by_size: Vec<usize> = (0..rows.len()).collect();
+    by_size.par_sort_unstable_by_key(|&index| Reverse(rows[index].total_size));
+    let mut by_modified: Vec<usize> = (0..rows.len()).collect();
+    by_modified.par_sort_unstable_by_key(|&index| rows[index].modified);
+
+    let mut out = BufWriter::new(File::create(path)?);
+    let count = rows.len() as u64;
+    let next_id = rows.last().unwrap().id + 1;
+    write_words(
+        &mut out,
+        [
+            MAGIC,
+            slots as u64,
+            count,
+            count,
+            0,
+            0,
+            next_id,
+            0,
+            snapshot_length,
+        ],
+    )?;
+    write_words(
+        &mut out,
+        table.iter().flat_map(|&(key, record)| [key, record]),
+    )?;
+    write_words(&mut out, by_size.iter().map(|&index| records[index]))?;
+    write_words(&mut out, by_modified.iter().map(|&index| records[index]))?;
+    for (index, row) in rows.iter().enumerate() {
+        let links = [
+            records[parents[index]],
+            first_child[index],
+            next_sibling[index],
+        ];
+        write_record(&mut out, row, links)?;
+    }
+    out.flush()
+}
+
+fn write_words(out: &mut impl Write, words: impl IntoIterator<Item = u64>) -> io::Result<()> {
+    for word in words {
+        out.write_all(&word.to_le_bytes())?;
+    }
+    Ok(())
+}
+
+fn record_words(name: &str) -> usize {
+    RECORD_WORDS + name.len().div_ceil(8)
+}
+
+/// Writes `row`'s record with its parent, first child and next sibling.
+fn write_record(
+    out: &mut impl Write,
+    row: &Row,
+    [parent, first_child, next_sibling]: [u64; 3],
+) -> io::Result<()> {
+    write_words(
+        out,
+        [
+            row.id,
+            parent,
+            row.total_size,
+            row.modified,
+            0,
+            row.batch,
+            first_child,
+            next_sibling,
+            row.name.len() as u64,
+        ],
+    )?;
+    out.write_all(row.name.as_bytes())?;
+    out.write_all(&[0; 7][..row.name.len().next_multiple_of(8) - row.name.len()])
+}
+
+/// A mapped index file.
+pub struct Index {
+    bytes: &'static [u8],
+}
+
+/// A directory found through the index: its record, id, the offset of the
+/// record batch holding its row, and its total. `record` is zero for ones
+/// found by reading the snapshot instead.
+#[derive(Clone, Copy)]
+pub struct Entry {
+    pub record: usize,
+    pub id: u64,
+    pub batch: u64,
+    pub total_size: u64,
+}
+
+impl Index {
+    pub fn open(path: &Path) -> io::Result<Index> {
+        let index = Index { bytes: map(path)? };
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not a dirsize index");
+        if index.bytes.len() < HEADER_WORDS * 8 || !index.bytes.len().is_multiple_of(8) {
+            return Err(invalid());
+        }
+        let words = index.bytes.len() / 8;
+        let [slots, base, delta, delta_length] =
+            [SLOTS, BASE_LENGTH, DELTA, DELTA_LENGTH].map(|word| index.word(word) as usize);
+        if index.word(0) != MAGIC
+            || !slots.is_power_of_two()
+            || HEADER_WORDS + slots * 2 + base * 2 > words
+            || delta + delta_length * 2 > words
+        {
+            return Err(invalid());
+        }
+        Ok(index)
+    }
+
+    fn word(&self, index: usize) -> u64 {
+        u64::from_le_bytes(self.bytes[index * 8..index * 8 + 8].try_into().unwrap())
+    }
+
+    fn slots(&self) -> usize {
+        self.word(SLOTS) as usize
+    }
+
+    /// The length of the snapshot the index was written or last patched for.
+    pub fn snapshot_length(&self) -> u64 {
+        self.word(SNAPSHOT_LENGTH)
+    }
+
+    /// An id above every row's.
+    pub fn next_id(&self) -> u64 {
+        self.word(NEXT_ID)
+    }
+
+    fn field(&self, record: usize, field: usize) -> u64 {
+        self.word(record + field)
+    }
+
+    fn is_dead(&self, record: usize) -> bool {
+        self.field(record, FLAGS) & DEAD != 0
+    }
+
+    fn parent(&self, record: usize) -> usize {
+        self.field(record, PARENT) as usize
+    }
+
+    fn name(&self, record: usize) -> &str {
+        let start = (record + RECORD_WORDS) * 8;
+        let length = self.field(record, NAME_LENGTH) as usize;
+        std::str::from_utf8(&self.bytes[start..start + length]).unwrap_or("?")
+    }
+
+    fn path(&self, record: usize) -> String {
+        let parent = self.parent(record);
+        if parent == record {
+            return self.name(record).to_owned();
+        }
+        format!(
+            "{}/{}",
+            self.path(parent).trim_end_matches('/'),
+            self.name(record)
+        )
+    }
+
+    /// The live record of `path`, checked against the stored path so that a
+    /// hash collision cannot return the wrong directory.
+    fn lookup(&self, path: &str) -> Option<usize> {
+        let key = path_key(path);
+        let mut slot = key as usize & (self.slots() - 1);
+        loop {
+            let (slot_key, record) = (
+                self.word(HEADER_WORDS + slot * 2),
+                self.word(HEADER_WORDS + slot * 2 + 1) as usize,
+            );
+            if record == 0 {
+                return None;
+            }
+            if slot_key == key
+                && !self.is_dead(record)
+                && self.path(record).trim_end_matches('/') == path.trim_end_matches('/')
+            {
+                return Some(record);
+            }
+            slot = (slot + 1) & (self.slots() - 1);
+        }
+    }
+
+    /// Live records ordered by `field`, `TOTAL_SIZE` largest first or
+    /// `MODIFIED` oldest first: the full order without the records that
+    /// moved since, merged with the refreshed order.
+    fn ordered(&self, field: usize) -> impl Iterator<Item = usize> + '_ {
+        let (base, delta) = (
+            self.word(BASE_LENGTH) as usize,
+            self.word(DELTA_LENGTH) as usize,
+        );
+        let (mut base_start, mut delta_start) =
+            (HEADER_WORDS + self.slots() * 2, self.word(DELTA) as usize);
+        if field == MODIFIED {
+            base_start += base;
+            delta_start += delta;
+        }
+        let key = move |record: usize| match field {
+            TOTAL_SIZE => u64::MAX - self.field(record, TOTAL_SIZE),
+            _ => self.field(record, MODIFIED),
+        };
+        let mut base = (base_start..base_start + base)
+            .map(|word| self.word(word) as usize)
+            .filter(|&record| self.field(record, FLAGS) & (DEAD | MOVED) == 0)
+            .peekable();
+        let mut delta = (delta_start..delta_start + delta)
+            .map(|word| self.word(word) as usize)
+            .filter(|&record| !self.is_dead(record))
+            .peekable();
+        std::iter::from_fn(move || match (base.peek(), delta.peek()) {
+            (Some(&first), Some(&second)) if key(second) < key(first) => delta.next(),
+            (Some(_), _) => base.next(),
+            (None, _) => delta.next(),
+        })
+    }
+
+    fn entry(&self, record: usize) -> Entry {
+        Entry {
+            record,
+            id: self.field(record, ID),
+            batch: self.field(record, BATCH),
+            total_size: self.field(record, TOTAL_SIZE),
+        }
+    }
+
+    pub fn find(&self, path: &str) -> Option<Entry> {
+        self.lookup(path).map(|record| self.entry(record))
+    }
+
+    /// Every live directory below `entry`.
+    pub fn descendants(&self, entry: &Entry) -> Vec<Entry> {
+        let mut found = Vec::new();
+        let mut stack = vec![self.field(entry.record, FIRST_CHILD) as usize];
+        while let Some(record) = stack.pop() {
+            if record == 0 {
+                continue;
+            }
+            stack.push(self.field(record, NEXT_SIBLING) as usize);
+            // A dead record's subtree died with it.
+            if !self.is_dead(record) {
+                found.push(self.entry(record));
+                stack.push(self.field(record, FIRST_CHILD) as usize);
+            }
+        }
+        found
+    }
+
+    /// The directories above `entry`, nearest first.
+    pub fn ancestors(&self, entry: &Entry) -> Vec<Entry> {
+        let mut found = Vec::new();
+        let mut record = entry.record;
+        while self.parent(record) != record {
+            record = self.parent(record);
+            found.push(self.entry(record));
+        }
+        found
+    }
+}
+
+/// What a refresh changed, for `patch`.
+pub struct Change {
+    pub target: Entry,
+    /// Every directory that was below the target, plus the target itself
+    /// if it is gone.
+    pub removed: Vec<Entry>,
+    pub ancestors: Vec<Entry>,
+    /// How much the ancestors' totals grew.
+    pub delta: i64,
+    /// The target's new total and modification time, unless it is gone.
+    pub target_row: Option<(u64, u64)>,
+    /// The rescanned subtree's rows, with ids from the index's `next_id` up.
+    pub added: Vec<Row>,
+    pub snapshot_length: u64,
+}
+
+/// Applies `change` to `index`, opened from `path`, in place: appends the
+/// new records and refreshed orders and patches the touched records, table
+/// slots and header. Returns false without writing anything when the index
+/// is due a rebuild instead.
+pub fn patch(path: &Path, index: &Index, mut change: Change) -> io::Result<bool> {
+    let slots = index.slots();
+    let used = index.word(USED) as usize + change.added.len();
+    if used * 4 > slots * 3 {
+        return Ok(false);
+    }
+
+    // New records are laid out in id order, which puts parents first.
+    change.added.sort_unstable_by_key(|row| row.id);
+    let target = &change.target;
+    let mut records = HashMap::from([(target.id, target.record as u64)]);
+    let mut hashes = HashMap::from([(target.id, path_key(&index.path(target.record)))]);
+    let mut end = index.bytes.len() / 8;
+    for row in &change.added {
+        let parent = hashes.get(&row.parent).ok_or_else(invalid)?;
+        hashes.insert(row.id, hash(*parent, format!("/{}", row.name).as_bytes()));
+        records.insert(row.id, end as u64);
+        end += record_words(&row.name);
+    }
+    let mut first_children = HashMap::new();
+    let mut next_siblings = vec![0; change.added.len()];
+    for (index, row) in change.added.iter().enumerate().rev() {
+        next_siblings[index] = first_children
+            .insert(row.parent, records[&row.id])
+            .unwrap_or(0);
+    }
+
+    let mut taken = HashSet::new();
+    let mut slot_writes = Vec::with_capacity(change.added.len());
+    for row in &change.added {
+        let key = hashes[&row.id];
+        let mut slot = key as usize & (slots - 1);
+        while index.word(HEADER_WORDS + slot * 2 + 1) != 0 || taken.contains(&slot) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        taken.insert(slot);
+        slot_writes.push((slot, key, records[&row.id]));
+    }
+
+    // The refreshed orders hold every touched record plus the still-live
+    // ones from the previous refreshes, with their new totals and times.
+    let removed: HashSet<usize> = change.removed.iter().map(|entry| entry.record).collect();
+    let mut values = HashMap::new();
+    let old_delta = index.word(DELTA) as usize;
+    let old_delta_length = index.word(DELTA_LENGTH) as usize;
+    for word in old_delta..old_delta + old_delta_length {
+        let record = index.word(word) as usize;
+        if !removed.contains(&record) && !index.is_dead(record) {
+            let total_size = index.field(record, TOTAL_SIZE);
+            values.insert(record, (total_size, index.field(record, MODIFIED)));
+        }
+    }
+    for ancestor in &change.ancestors {
+        let total_size = ancestor.total_size.saturating_add_signed(change.delta);
+        values.insert(
+            ancestor.record,
+            (total_size, index.field(ancestor.record, MODIFIED)),
+        );
+    }
+    if let Some(row) = change.target_row {
+        values.insert(target.record, row);
+    }
+    for row in &change.added {
+        values.insert(records[&row.id] as usize, (row.total_size, row.modified));
+    }
+    let garbage = index.word(GARBAGE) as usize
+        + old_delta_length * 2
+        + change
+            .removed
+            .iter()
+            .map(|entry| {
+                RECORD_WORDS + (index.field(entry.record, NAME_LENGTH) as usize).div_ceil(8)
+            })
+            .sum::<usize>();
+    if values.len() * 4 > index.word(BASE_LENGTH) as usize || garbage * 2 > end {
+        return Ok(false);
+    }
+    let mut by_size: Vec<usize> = values.keys().copied().collect();
+    by_size.sort_unstable_by_key(|record| Reverse(values[record].0));
+    let mut by_modified = by_size.clone();
+    by_modified.sort_unstable_by_key(|record| values[record].1);
+
+    // Everything is read before anything is written, since the map may or
+    // may not see the writes.
+    let mut writes = Vec::new();
+    for entry in &change.removed {
+        writes.push((
+            entry.record + FLAGS,
+            index.field(entry.record, FLAGS) | DEAD,
+        ));
+    }
+    for ancestor in &change.ancestors {
+        let flags = index.field(ancestor.record, FLAGS) | MOVED;
+        writes.push((ancestor.record + TOTAL_SIZE, values[&ancestor.record].0));
+        writes.push((ancestor.record + FLAGS, flags));
+    }
+    if let Some((total_size, modified)) = change.target_row {
+        let first_child = first_children.get(&target.id).copied().unwrap_or(0);
+        writes.push((target.record + TOTAL_SIZE, total_size));
+        writes.push((target.record + MODIFIED, modified));
+        writes.push((
+            target.record + FLAGS,
+            index.field(target.record, FLAGS) | MOVED,
+        ));
+        writes.push((target.record + FIRST_CHILD, first_child));
+    }
+    for &(slot, key, record) in &slot_writes {
+        writes.push((HEADER_WORDS + slot * 2, key));
+        writes.push((HEADER_WORDS + slot * 2 + 1, record));
+    }
+    let next_id = change
+        .added
+        .last()
+        .map_or(index.next_id(), |row| row.id + 1);
+    writes.extend([
+        (USED, used as u64),
+        (DELTA, end as u64),
+        (DELTA_LENGTH, values.len() as u64),
+        (NEXT_ID, next_id),
+        (GARBAGE, garbage as u64),
+        (SNAPSHOT_LENGTH, change.snapshot_length),
+    ]);
+
+    // Appended words go first and the header last, so an index cut short
+    // by a crash still describes its old contents.
+    let mut file = OpenOptions::new().write(true).open(path)?;
+    file.seek(SeekFrom::Start(index.bytes.len() as u64))?;
+    let mut out = BufWriter::new(&mut file);
+    for (row, next_sibling) in change.added.iter().zip(next_siblings) {
+        let first_child = first_children.get(&row.id).copied().unwrap_or(0);
+        write_record(
+            &mut out,
+            row,
+            [records[&row.parent], first_child, next_sibling],
+        )?;
+    }
+    write_words(&mut out, by_size.iter().map(|&record| record as u64))?;
+    write_words(&mut out, by_modified.iter().map(|&record| record as u64))?;
+    out.flush()?;
+    drop(out);
+    for (word, value) in writes {
+        file.seek(SeekFrom::Start(word as u64 * 8))?;
+        file.write_all(&value.to_le_bytes())?;
+    }
+    Ok(true)
+}
+
+/// Answers `query` from the index at `path`. Directories modified less than
+/// `older_than` ago are left out of listings when it is given, and ones
+/// modified at an unknown time whenever age matters.
+pub fn query(path: &Path, query: &Query, older_than: Option<Duration>) {
+    let index = Index::open(path).unwrap_or_else(|error| {
+        eprintln!("dirsize: cannot read index {}: {error}", path.display());
+        process::exit(1);
+    });
+    let mut cutoff = older_than.map(|older_than| {
+        (SystemTime::now() - older_than)
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |since| since.as_secs())
+    });
+    if let Query::Oldest(_) = query {
+        cutoff.get_or_insert(u64::MAX);
+    }
+    let old_enough = |record: usize| {
+        let modified = index.field(record, MODIFIED);
+        cutoff.is_none_or(|cutoff| modified != 0 && modified <= cutoff)
+    };
+
+    let (order, count) = match *query {
+        Query::Path(ref directory) => {
+            // Snapshot roots are canonical, so `./t/a` finds `/tmp/t/a`. A
+            // directory removed since is made absolute without resolving
+            // it, and snapshots written before roots were canonicalized
+            // are still searched for the path as typed.
+            let normalized = fs::canonicalize(directory)
+                .or_else(|_| std::path::absolute(directory))
+                .ok();
+            let normalized = normalized.as_deref().and_then(Path::to_str);
+            let record = normalized
+                .and_then(|normalized| index.lookup(normalized))
+                .or_else(|| index.lookup(directory));
+            let Some(record) = record else {
+                eprintln!("dirsize: {directory} is not in the snapshot");
+                process::exit(1);
+            };
+            let total_size = index.field(record, TOTAL_SIZE);
+            println!("{}: {total_size} bytes", index.path(record));
+            return;
+        }
+        Query::Largest(count) => (TOTAL_SIZE, count),
+        Query::Oldest(count) => (MODIFIED, count),
+    };
+    for record in index
+        .ordered(order)
+        .filter(|&record| old_enough(record))
+        .take(count)
+    {
+        let total_size = index.field(record, TOTAL_SIZE);
+        println!("{}: {total_size} bytes", index.path(record));
+    }
+}
+
+/// Maps `path` read-only for the rest of the process.
+#[cfg(target_os = "linux")]
+fn map(path: &Path) -> io::Result<&'static [u8]> {
+    use std::os::fd::AsRawFd;
+
+    let file = File::open(path)?;
+    let length = file.metadata()?.len() as usize;
+    if length == 0 {
+        return Ok(&[]);
+    }
+    let address = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            length,
+            libc::PROT_READ,
+            libc::MAP_PRIVATE,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    if address == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(unsafe { std::slice::from_raw_parts(address.cast::<u8>(), length) })
+}
+
+#[cfg(not(target_os = "linux"))]
+fn map(path: &Path) -> io::Result<&'static [u8]> {
+    Ok(std::fs::read(path)?.leak())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn row(id: u64, parent: u64, name: &str, total_size: u64, modified: u64) -> Row {
+        Row {
+            id,
+            parent,
+            name: name.to_owned(),
+            total_size,
+            modified,
+            batch: 0,
+        }
+    }
+
+    /// `/r` with directories `0` to `9`, each holding one `x`.
+    fn rows() -> Vec<Row> {
+        let mut rows = vec![row(0, 0, "/r", 1000, 50)];
+        for n in 0..10 {
+            rows.push(row(1 + n * 2, 0, &n.to_string(), 10 + n * 10, 100 - n));
+            rows.push(row(2 + n * 2, 1 + n * 2, "x", 5, 200 + n));
+        }
+        rows
+    }
+
+    fn paths(index: &Index, field: usize) -> Vec<String> {
+        index
+            .ordered(field)
+            .map(|record| index.path(record))
+            .collect()
+    }
+
+    fn scratch(name: &str) -> std::path::PathBuf {
+        std::env::temp_dir().join(format!("dirsize-{name}-{}", std::process::id()))
+    }
+
+    #[test]
+    fn lookups_and_orders() {
+        let path = scratch("index");
+        write(&path, rows(), 0).unwrap();
+        let index = Index::open(&path).unwrap();
+
+        assert_eq!(index.find("/r/3/x").map(|entry| entry.id), Some(8));
+        assert_eq!(index.find("/r/3/").map(|entry| entry.id), Some(7));
+        assert_eq!(index.find("/r").map(|entry| entry.id), Some(0));
+        assert!(index.find("/r/3/y").is_none());
+        assert_eq!(paths(&index, TOTAL_SIZE)[..3], ["/r", "/r/9", "/r/8"]);
+        assert_eq!(paths(&index, MODIFIED)[..3], ["/r", "/r/9", "/r/8"]);
+        assert_eq!(paths(&index, TOTAL_SIZE).len(), 21);
+        fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn patches_merge_with_the_full_orders() {
+        let path = scratch("patched-index");
+        write(&path, rows(), 0).unwrap();
+        let index = Index::open(&path).unwrap();
+        let target = index.find("/r/3").unwrap();
+        let change = Change {
+            removed: index.descendants(&target),
+            ancestors: index.ancestors(&target),
+            delta: 5000 - target.total_size as i64,
+            target_row: Some((5000, 10)),
+            added: vec![row(21, 7, "y", 4900, 300)],
+            snapshot_length: 0,
+            target,
+        };
+        assert!(patch(&path, &index, change).unwrap());
+
+        let index = Index::open(&path).unwrap();
+        assert!(index.find("/r/3/x").is_none());
+        assert_eq!(
+            index.find("/r/3/y").map(|entry| entry.total_size),
+            Some(4900)
+        );
+        assert_eq!(index.find("/r").map(|entry| entry.total_size), Some(5960));
+        assert_eq!(
+            paths(&index, TOTAL_SIZE)[..4],
+            ["/r", "/r/3", "/r/3/y", "/r/9"]
+        );
+        assert_eq!(paths(&index, MODIFIED)[..3], ["/r/3", "/r", "/r/9"]);
+        assert_eq!(paths(&index, MODIFIED).last().unwrap(), "/r/3/y");
+        assert_eq!(paths(&index, TOTAL_SIZE).len(), 21);
+        assert_eq!(index.next_id(), 22);
+        fs::remove_file(path).unwrap();
+    }
+}
@@ -0,0 +1,205 @@
+use std::collections::HashMap;
+use std::path::Path;
+use std::time::Duration;
+
+/// Kernel change notification for a bounded set of directories, keyed by
+/// tree node. On platforms without inotify nothing is ever watched and
+/// `wait` only sleeps, which leaves every directory to polling; the same
+/// holds for a disabled watcher, used when inotify cannot be initialised.
+pub struct Watcher {
+    #[cfg(target_os = "linux")]
+    fd: Option<std::os::fd::OwnedFd>,
+    #[cfg(target_os = "linux")]
+    by_descriptor: HashMap<i32, usize>,
+    by_node: HashMap<usize, i32>,
+}
+
+/// Upper bound on watches when the user gives no budget: half the
+/// per-user limit, leaving the rest for other programs.
+pub fn default_budget() -> usize {
+    if cfg!(target_os = "linux") {
+        std::fs::read_to_string("/proc/sys/fs/inotify/max_user_watches")
+            .ok()
+            .and_then(|limit| limit.trim().parse::<usize>().ok())
+            .map_or(0, |limit| limit / 2)
+    } else {
+        0
+    }
+}
+
+impl Watcher {
+    /// A watcher that never watches anything.
+    pub fn disabled() -> Watcher {
+        Watcher {
+            #[cfg(target_os = "linux")]
+            fd: None,
+            #[cfg(target_os = "linux")]
+            by_descriptor: HashMap::new(),
+            by_node: HashMap::new(),
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.by_node.len()
+    }
+
+    pub fn is_watched(&self, index: usize) -> bool {
+        self.by_node.contains_key(&index)
+    }
+
+    pub fn watched(&self) -> impl Iterator<Item = usize> + '_ {
+        self.by_node.keys().copied()
+    }
+
+    /// Follows the nodes to their new indices after `Tree::compact`,
+    /// unwatching the ones it dropped.
+    pub fn renumber(&mut self, remap: &[Option<usize>]) {
+        for (index, descriptor) in std::mem::take(&mut self.by_node) {
+            match remap[index] {
+                Some(index) => {
+                    self.by_node.insert(index, descriptor);
+                }
+                None => self.release(descriptor),
+            }
+        }
+        #[cfg(target_os = "linux")]
+        {
+            self.by_descriptor = self
+                .by_node
+                .iter()
+                .map(|(&index, &descriptor)| (descriptor, index))
+                .collect();
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+impl Watcher {
+    pub fn new() -> std::io::Result<Watcher> {
+        use std::os::fd::{FromRawFd, OwnedFd};
+
+        let fd = unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(Watcher {
+            fd: Some(unsafe { OwnedFd::from_raw_fd(fd) }),
+            ..Watcher::disabled()
+        })
+    }
+
+    pub fn watch(&mut self, index: usize, path: &Path) -> bool {
+        use std::ffi::CString;
+        use std::os::fd::AsRawFd;
+        use std::os::unix::ffi::OsStrExt;
+
+        let Some(fd) = &self.fd else {
+            return false;
+        };
+        let Ok(path) = CString::new(path.as_os_str().as_bytes()) else {
+            return false;
+        };
+        let mask = libc::IN_CREATE
+            | libc::IN_DELETE
+            | libc::IN_MOVED_FROM
+            | libc::IN_MOVED_TO
+            | libc::IN_DELETE_SELF
+            | libc::IN_MOVE_SELF
+            | libc::IN_ONLYDIR;
+        let descriptor = unsafe { libc::inotify_add_watch(fd.as_raw_fd(), path.as_ptr(), mask) };
+        if descriptor < 0 {
+            return false;
+        }
+        self.by_descriptor.insert(descriptor, index);
+        self.by_node.insert(index, descriptor);
+        true
+    }
+
+    pub fn unwatch(&mut self, index: usize) {
+        if let Some(descriptor) = self.by_node.remove(&index) {
+            self.release(descriptor);
+        }
+    }
+
+    fn release(&mut self, descriptor: i32) {
+        use std::os::fd::AsRawFd;
+
+        self.by_descriptor.remove(&descriptor);
+        if let Some(fd) = &self.fd {
+            unsafe { libc::inotify_rm_watch(fd.as_raw_fd(), descriptor) };
+        }
+    }
+
+    /// Blocks for up to `timeout` and collects the nodes that saw events.
+    /// Returns true if the kernel queue overflowed, in which case events
+    /// were lost and every watched directory has to be re-read.
+    pub fn wait(&mut self, timeout: Duration, dirty: &mut Vec<usize>) -> bool {
+        use std::os::fd::AsRawFd;
+
+        let Some(fd) = self.fd.as_ref().map(AsRawFd::as_raw_fd) else {
+            std::thread::sleep(timeout);
+            return false;
+        };
+        let mut poll = libc::pollfd {
+            fd,
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        let timeout = timeout.as_millis().min(i32::MAX as u128) as i32;
+        if unsafe { libc::poll(&mut poll, 1, timeout) } <= 0 {
+            return false;
+        }
+
+        let mut overflowed = false;
+        let mut buffer = [0u8; 64 * 1024];
+        loop {
+            let read = unsafe { libc::read(fd, buffer.as_mut_ptr().cast(), buffer.len()) };
+            if read <= 0 {
+                return overflowed;
+            }
+
+            let mut offset = 0;
+            while offset < read as usize {
+                let event = unsafe {
+                    buffer
+                        .as_ptr()
+                        .add(offset)
+                        .cast::<libc::inotify_event>()
+                        .read_unaligned()
+                };
+                offset += std::mem::size_of::<libc::inotify_event>() + event.len as usize;
+
+                if event.mask & libc::IN_Q_OVERFLOW != 0 {
+                    overflowed = true;
+                } else if event.mask & libc::IN_IGNORED != 0 {
+                    if let Some(index) = self.by_descriptor.remove(&event.wd) {
+                        self.by_node.remove(&index);
+                        dirty.push(index);
+                    }
+                } else if let Some(&index) = self.by_descriptor.get(&event.wd) {
+                    dirty.push(index);
+                }
+            }
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+impl Watcher {
+    pub fn new() -> std::io::Result<Watcher> {
+        Ok(Watcher::disabled())
+    }
+
+    pub fn watch(&mut self, _index: usize, _path: &Path) -> bool {
+        false
+    }
+
+    pub fn unwatch(&mut self, _index: usize) {}
+
+    fn release(&mut self, _descriptor: i32) {}
+
+    pub fn wait(&mut self, timeout: Duration, _dirty: &mut Vec<usize>) -> bool {
+        std::thread::sleep(timeout);
+        false
+    }
+}
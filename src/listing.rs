@@ -0,0 +1,384 @@
+use std::fs::Metadata;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::{Duration, SystemTime};
+
+/// Directory timestamps are coarse (a clock tick on most Linux filesystems,
+/// two seconds on FAT), so a directory changed this close before its read
+/// may have changed again during it without its timestamps moving.
+const TIMESTAMP_SLACK: Duration = Duration::from_secs(2);
+
+static CHECK_CHANGES: AtomicBool = AtomicBool::new(false);
+
+/// What a scan needs from one directory: its own size, how many entries it
+/// has and which of them are directories, symlinks to directories included,
+/// plus the device it lives on.
+#[derive(Default)]
+pub struct Listing {
+    pub size: u64,
+    pub modified: Option<SystemTime>,
+    pub device: u64,
+    pub entries: u64,
+    pub subdirectories: Vec<PathBuf>,
+    /// Positions in `subdirectories` of the ones that are symlinks,
+    /// ascending.
+    pub links: Vec<usize>,
+    /// Whether the directory may have changed while it was being read, so
+    /// the listing can mix states from before and after. Only checked
+    /// after `check_changes`.
+    pub changed: bool,
+}
+
+impl Listing {
+    /// Whether `subdirectories[position]` is a symlink.
+    pub fn is_link(&self, position: usize) -> bool {
+        self.links.binary_search(&position).is_ok()
+    }
+
+    /// The subdirectories, each with whether it is a symlink.
+    pub fn into_subdirectories(self) -> impl Iterator<Item = (PathBuf, bool)> {
+        let mut links = self.links.into_iter().peekable();
+        self.subdirectories
+            .into_iter()
+            .enumerate()
+            .map(move |(position, path)| (path, links.next_if_eq(&position).is_some()))
+    }
+}
+
+/// Makes every later listing fstat its directory again once read, to set
+/// `Listing::changed`.
+pub fn check_changes() {
+    CHECK_CHANGES.store(true, Ordering::Relaxed);
+}
+
+/// Compares the fstat taken before a read with one taken after it.
+fn changed_during_read(before: &Metadata, after: &Metadata) -> bool {
+    let changed = changed(before);
+    changed != self::changed(after)
+        || before.len() != after.len()
+        || changed + TIMESTAMP_SLACK >= SystemTime::now()
+}
+
+/// The later of a directory's mtime and ctime.
+#[cfg(unix)]
+fn changed(metadata: &Metadata) -> SystemTime {
+    use std::os::unix::fs::MetadataExt;
+
+    let ctime = Duration::new(
+        metadata.ctime().max(0) as u64,
+        metadata.ctime_nsec().clamp(0, 999_999_999) as u32,
+    );
+    let ctime = SystemTime::UNIX_EPOCH + ctime;
+    metadata
+        .modified()
+        .map_or(ctime, |modified| modified.max(ctime))
+}
+
+#[cfg(not(unix))]
+fn changed(metadata: &Metadata) -> SystemTime {
+    metadata.modified().unwrap_or_else(|_| SystemTime::now())
+}
+
+/// Like `list`, but a directory that cannot be read, usually for lack of
+/// permission, still counts its own size instead of failing the scan.
+/// This is how `Tree` has always counted such directories, and every
+/// engine has to agree with it.
+pub fn list_or_size(path: &Path) -> Listing {
+    list(path).unwrap_or_else(|_| {
+        let metadata = std::fs::metadata(path);
+        // A directory that vanished mid-scan left its parent's listing out
+        // of date; one that cannot be opened, such as a path that followed
+        // too many symlinks, did not.
+        let vanished = matches!(&metadata, Err(error) if error.kind() == io::ErrorKind::NotFound);
+        let metadata = metadata.ok();
+        Listing {
+            size: metadata.as_ref().map_or(0, |metadata| metadata.len()),
+            modified: metadata
+                .as_ref()
+                .and_then(|metadata| metadata.modified().ok()),
+            device: metadata.as_ref().map_or(0, device),
+            changed: vanished && CHECK_CHANGES.load(Ordering::Relaxed),
+            ..Listing::default()
+        }
+    })
+}
+
+/// Lists `path` by walking raw `getdents64` records. Where the probe for
+/// the directory's device found `d_type` trustworthy, entries that are not
+/// directories or symlinks are classified without a `stat`, which is what
+/// `Path::is_dir` would otherwise cost per entry.
+#[cfg(target_os = "linux")]
+pub fn list(path: &Path) -> io::Result<Listing> {
+    use crate::capabilities;
+    use std::ffi::OsStr;
+    use std::os::unix::ffi::OsStrExt;
+    use std::os::unix::fs::MetadataExt;
+
+    let directory = open_directory(path)?;
+    let metadata = directory.metadata()?;
+    let trust_d_type = capabilities::for_directory(metadata.dev(), &directory, path).trust_d_type;
+    let mut listing = Listing {
+        size: metadata.len(),
+        modified: metadata.modified().ok(),
+        device: metadata.dev(),
+        ..Listing::default()
+    };
+
+    for_each_record(&directory, |name, kind| {
+        listing.entries += 1;
+        let sub_path = || path.join(OsStr::from_bytes(name));
+        let (is_dir, is_link) = match kind {
+            libc::DT_DIR if trust_d_type => (true, false),
+            libc::DT_LNK if trust_d_type => (sub_path().is_dir(), true),
+            libc::DT_UNKNOWN => classify(&sub_path()),
+            _ if trust_d_type => (false, false),
+            _ => classify(&sub_path()),
+        };
+        if is_dir {
+            if is_link {
+                listing.links.push(listing.subdirectories.len());
+            }
+            listing.subdirectories.push(sub_path());
+        }
+    })?;
+    if CHECK_CHANGES.load(Ordering::Relaxed) {
+        listing.changed = changed_during_read(&metadata, &directory.metadata()?);
+    }
+    Ok(listing)
+}
+
+/// Whether `path` is a directory, following symlinks, and whether it is a
+/// symlink itself.
+#[cfg(target_os = "linux")]
+fn classify(path: &Path) -> (bool, bool) {
+    match std::fs::symlink_metadata(path) {
+        Ok(metadata) if metadata.is_symlink() => (path.is_dir(), true),
+        Ok(metadata) => (metadata.is_dir(), false),
+        Err(_) => (false, false),
+    }
+}
+
+#[cfg(target_os = "linux")]
+pub fn open_directory(path: &Path) -> io::Result<std::fs::File> {
+    use std::fs::OpenOptions;
+    use std::os::unix::fs::OpenOptionsExt;
+
+    OpenOptions::new()
+        .read(true)
+        .custom_flags(libc::O_DIRECTORY | libc::O_CLOEXEC)
+        .open(path)
+}
+
+/// Calls `visit` with the name and `d_type` of every entry of `directory`
+/// except `.` and `..`, reading `linux_dirent64` records in bulk.
+#[cfg(target_os = "linux")]
+pub fn for_each_record(
+    directory: &std::fs::File,
+    mut visit: impl FnMut(&[u8], u8),
+) -> io::Result<()> {
+    use std::cell::Cell;
+    use std::os::fd::AsRawFd;
+
+    thread_local! {
+        /// getdents64 buffer kept per thread, so listing a directory does
+        /// not allocate and zero one. It is taken out while in use, which
+        /// leaves a nested call its own.
+        static BUFFER: Cell<Vec<u8>> = const { Cell::new(Vec::new()) };
+    }
+
+    let mut buffer = BUFFER.take();
+    if buffer.is_empty() {
+        buffer = vec![0u8; 32 * 1024];
+    }
+    let result = read_records(directory.as_raw_fd(), &mut buffer, &mut visit);
+    BUFFER.set(buffer);
+    result
+}
+
+#[cfg(target_os = "linux")]
+fn read_records(
+    fd: std::os::fd::RawFd,
+    buffer: &mut [u8],
+    visit: &mut impl FnMut(&[u8], u8),
+) -> io::Result<()> {
+    const NAME_OFFSET: usize = 19;
+
+    loop {
+        let read =
+            unsafe { libc::syscall(libc::SYS_getdents64, fd, buffer.as_mut_ptr(), buffer.len()) };
+        if read < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        if read == 0 {
+            return Ok(());
+        }
+
+        let mut offset = 0;
+        while offset < read as usize {
+            let record_len =
+                u16::from_ne_bytes([buffer[offset + 16], buffer[offset + 17]]) as usize;
+            let kind = buffer[offset + 18];
+            let name = &buffer[offset + NAME_OFFSET..offset + record_len];
+            let name = &name[..name_len(name)];
+            offset += record_len;
+
+            if name != b"." && name != b".." {
+                visit(name, kind);
+            }
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn list(path: &Path) -> io::Result<Listing> {
+    let metadata = std::fs::metadata(path)?;
+    let mut listing = Listing {
+        size: metadata.len(),
+        modified: metadata.modified().ok(),
+        device: device(&metadata),
+        ..Listing::default()
+    };
+    for entry in std::fs::read_dir(path)? {
+        let entry = entry?;
+        let sub_path = entry.path();
+        listing.entries += 1;
+        if sub_path.is_dir() {
+            if entry.file_type().is_ok_and(|kind| kind.is_symlink()) {
+                listing.links.push(listing.subdirectories.len());
+            }
+            listing.subdirectories.push(sub_path);
+        }
+    }
+    if CHECK_CHANGES.load(Ordering::Relaxed) {
+        listing.changed = changed_during_read(&metadata, &std::fs::metadata(path)?);
+    }
+    Ok(listing)
+}
+
+#[cfg(unix)]
+pub fn device(metadata: &std::fs::Metadata) -> u64 {
+    use std::os::unix::fs::MetadataExt;
+    metadata.dev()
+}
+
+#[cfg(not(unix))]
+pub fn device(_metadata: &std::fs::Metadata) -> u64 {
+    0
+}
+
+/// Length of the NUL-terminated name at the start of `bytes`. Names are
+/// searched a word at a time with the usual has-zero-byte trick, and the
+/// last few bytes of the record fall back to a plain byte scan.
+#[cfg(target_os = "linux")]
+fn name_len(bytes: &[u8]) -> usize {
+    const LOW_BITS: u64 = 0x0101_0101_0101_0101;
+    const HIGH_BITS: u64 = 0x8080_8080_8080_8080;
+
+    let mut offset = 0;
+    while offset + 8 <= bytes.len() {
+        let word = u64::from_le_bytes(bytes[offset..offset + 8].try_into().unwrap());
+        let zero = word.wrapping_sub(LOW_BITS) & !word & HIGH_BITS;
+        if zero != 0 {
+            return offset + (zero.trailing_zeros() / 8) as usize;
+        }
+        offset += 8;
+    }
+
+    bytes[offset..]
+        .iter()
+        .position(|&byte| byte == 0)
+        .map_or(bytes.len(), |position| offset + position)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::collections::BTreeSet;
+    use std::fs;
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn name_len_at_word_and_padding_boundaries() {
+        for length in 1..=16 {
+            for name in [b'a', 0x01, 0x80, 0xff] {
+                let name = vec![name; length];
+                // Records are padded to 8 bytes, so the NUL can be the last
+                // byte of the slice or be followed by padding of any size.
+                for padding in 0..=8 {
+                    let mut bytes = name.clone();
+                    bytes.push(0);
+                    bytes.extend(std::iter::repeat_n(0xaa, padding));
+                    assert_eq!(name_len(&bytes), length, "{length} + {padding}");
+                }
+                assert_eq!(name_len(&name), length, "{length} unterminated");
+            }
+        }
+    }
+
+    /// A fresh directory under the system temporary directory.
+    fn scratch(name: &str) -> PathBuf {
+        let path = std::env::temp_dir().join(format!("dirsize-{name}-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&path);
+        fs::create_dir_all(&path).unwrap();
+        path
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn list_matches_read_dir() {
+        use std::os::unix::fs::symlink;
+
+        let root = scratch("listing");
+        fs::create_dir(root.join("directory")).unwrap();
+        fs::create_dir(root.join("other")).unwrap();
+        fs::write(root.join("file"), b"contents").unwrap();
+        symlink(root.join("directory"), root.join("directory-link")).unwrap();
+        symlink(root.join("file"), root.join("file-link")).unwrap();
+        symlink(root.join("missing"), root.join("dangling")).unwrap();
+        symlink(&root, root.join("loop")).unwrap();
+        // Enough names of every length to take several getdents64 reads.
+        for index in 0..2000 {
+            let name = format!("{index}{}", "x".repeat(index % 40));
+            if index % 3 == 0 {
+                fs::create_dir(root.join(name)).unwrap();
+            } else {
+                fs::write(root.join(name), b"").unwrap();
+            }
+        }
+
+        let listing = list(&root).unwrap();
+        let mut entries = 0;
+        let mut subdirectories = BTreeSet::new();
+        let mut links = BTreeSet::new();
+        for entry in fs::read_dir(&root).unwrap() {
+            let entry = entry.unwrap();
+            let path = entry.path();
+            entries += 1;
+            if path.is_dir() {
+                if entry.file_type().unwrap().is_symlink() {
+                    links.insert(path.clone());
+                }
+                subdirectories.insert(path);
+            }
+        }
+        assert_eq!(listing.size, fs::metadata(&root).unwrap().len());
+        assert_eq!(listing.entries, entries);
+        let listed: Vec<_> = listing.into_subdirectories().collect();
+        assert_eq!(
+            listed
+                .iter()
+                .map(|(path, _)| path.clone())
+                .collect::<BTreeSet<_>>(),
+            subdirectories
+        );
+        assert_eq!(
+            listed
+                .into_iter()
+                .filter_map(|(path, linked)| linked.then_some(path))
+                .collect::<BTreeSet<_>>(),
+            links
+        );
+        fs::remove_dir_all(&root).unwrap();
+    }
+}
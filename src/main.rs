@@ -1,55 +1,399 @@
+mod arrow;
+mod bench;
+#[cfg(target_os = "linux")]
+mod capabilities;
+mod churn;
+mod consistency;
+mod devices;
+mod export;
+mod index;
+mod inotify;
+mod listing;
+mod memory;
+mod options;
+mod pattern;
+mod progress;
+#[cfg(target_os = "linux")]
+mod reconcile;
+mod shape;
+mod shared;
+mod sinks;
+mod throttle;
+mod tree;
+#[cfg(unix)]
+mod verify;
+mod watch;
+
+use consistency::Consistency;
+use options::Options;
+use progress::Format;
 use rayon::prelude::*;
+use shape::Shape;
+use shared::{Claim, SharedCache};
+use sinks::Sinks;
 use std::fs;
-use std::path::Path;
-use std::sync::Arc;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use throttle::Throttle;
+
+#[global_allocator]
+static ALLOCATOR: bench::CountingAllocator = bench::CountingAllocator;
+
+/// Entries the main thread reads before handing what is left to the rayon pool.
+/// Small trees finish inside this budget and never start the pool at all.
+const FAST_PATH_BUDGET: usize = 512;
 
 fn main() {
-    let directory = ".";
-
-    let paths = fs::read_dir(directory)
-        .unwrap()
-        .map(|res| res.map(|entry| entry.path()))
-        .collect::<Result<Vec<_>, _>>()
-        .unwrap();
-
-    let directories = paths
-        .into_par_iter()
-        .filter_map(|path| if path.is_dir() { Some(path) } else { None })
-        .collect::<Vec<_>>();
-
-    let directory_sizes: Vec<_> = directories
-        .par_iter()
-        .map(|path| {
-            let size = calculate_directory_size(path);
-            (path.to_str().unwrap().to_owned(), size)
-        })
-        .collect();
+    let options = Options::parse();
+    if let Some(limit) = options.memory_limit {
+        memory::set_limit(limit);
+    }
+    if let Some((baseline, current)) = &options.compare {
+        bench::compare(baseline, current);
+        return;
+    }
+    if let Some((index, query)) = &options.query {
+        index::query(index, query, options.older_than);
+        return;
+    }
+    if options.bench {
+        bench::run(&options.root, options.runs.unwrap_or(bench::DEFAULT_RUNS));
+        return;
+    }
+    if options.verify {
+        #[cfg(unix)]
+        {
+            let root = (!options.generate).then_some(&*options.root);
+            if let Err(error) = verify::run(root, options.seed) {
+                eprintln!("dirsize: {error}");
+                std::process::exit(1);
+            }
+        }
+        #[cfg(not(unix))]
+        eprintln!("dirsize: verify is only supported on Unix");
+        return;
+    }
+    if let Some((snapshot, path)) = &options.refresh {
+        export::refresh(snapshot, path);
+        return;
+    }
+    if let Some(interval) = options.watch {
+        watch::run(&options, interval);
+        return;
+    }
+    if options.reconcile {
+        #[cfg(target_os = "linux")]
+        reconcile::run(&options.root);
+        #[cfg(not(target_os = "linux"))]
+        eprintln!("dirsize: --reconcile is only supported on Linux");
+        return;
+    }
 
+    let sinks = (!options.sinks.is_empty()).then(|| Sinks::open(&options.sinks));
+    let directory_sizes = match &options.arrow {
+        Some(output) if output == Path::new("-") => {
+            export::scan(&options.root, output, false);
+            return;
+        }
+        Some(output) => export::scan(&options.root, output, options.index),
+        None => directory_sizes(&options, sinks.as_ref()),
+    };
+    #[cfg(target_os = "linux")]
+    if options.probe {
+        report_capabilities();
+    }
+    if let Some(sinks) = sinks {
+        if !sinks.finish(&directory_sizes) {
+            std::process::exit(1);
+        }
+        return;
+    }
+    if options.progress == Some(Format::Ndjson) {
+        return;
+    }
+    let total: u64 = directory_sizes.iter().map(|(_, size)| size).sum();
     for (directory, size) in directory_sizes {
         println!("{directory}: {size} bytes");
     }
+    if options.pattern {
+        println!("total: {total} bytes");
+    }
 }
 
-fn calculate_directory_size(path: &Path) -> u64 {
-    let metadata = fs::metadata(path).unwrap();
-    let mut size = metadata.len();
+fn directory_sizes(options: &Options, sinks: Option<&Sinks>) -> Vec<(String, u64)> {
+    let consistency = options.consistency.then(Consistency::new);
+    let consistency = consistency.as_ref();
+    let shared = options.shared_cache.as_ref().map(|path| {
+        SharedCache::open(path).unwrap_or_else(|error| {
+            eprintln!(
+                "dirsize: cannot open shared cache {}: {error}",
+                path.display()
+            );
+            std::process::exit(1);
+        })
+    });
+    let shared = shared.as_ref();
+    let throttle = options.throttle.then(|| {
+        Throttle::new(if options.per_device {
+            devices::workers()
+        } else {
+            rayon::current_num_threads()
+        })
+    });
+    let throttle = throttle.as_ref();
+    let mut directory_sizes = Vec::new();
+    // Each pending directory comes with whether it was reached through a
+    // symlink, below which nothing is shared with other processes.
+    let mut pending: Vec<(usize, PathBuf, bool)> = Vec::new();
 
-    if metadata.is_dir() {
-        let paths = fs::read_dir(path)
+    let roots: Vec<_> = if options.pattern {
+        pattern::expand(&options.root)
+            .into_iter()
+            .map(|path| {
+                let linked =
+                    fs::symlink_metadata(&path).is_ok_and(|metadata| metadata.is_symlink());
+                (path, linked)
+            })
+            .collect()
+    } else {
+        listing::list(&options.root)
             .unwrap()
-            .map(|res| res.map(|entry| entry.path()))
-            .collect::<Result<Vec<_>, _>>()
-            .unwrap();
+            .into_subdirectories()
+            .collect()
+    };
+    if options.pattern && roots.is_empty() {
+        eprintln!("dirsize: nothing matches {}", options.root.display());
+        std::process::exit(1);
+    }
+    let shape = options
+        .shape
+        .then(|| roots.first().map(|(top_level, _)| Shape::new(top_level)))
+        .flatten();
+    let shape = shape.as_ref();
+    for (path, linked) in roots {
+        pending.push((directory_sizes.len(), path.clone(), linked));
+        directory_sizes.push((path.to_str().unwrap().to_owned(), 0));
+    }
+
+    let mut budget = FAST_PATH_BUDGET;
+    while budget > 0 {
+        let Some((index, path, linked)) = pending.pop() else {
+            break;
+        };
+        let listing = listing::list_or_size(&path);
+        if let Some(consistency) = consistency {
+            consistency.observe(index, &path, linked, &listing);
+        }
+        if let Some(shape) = shape {
+            shape.record(&path, &listing);
+        }
+        directory_sizes[index].1 += listing.size;
+        budget = budget.saturating_sub(listing.entries as usize);
+        pending.extend(
+            listing
+                .into_subdirectories()
+                .map(|(sub_path, is_link)| (index, sub_path, linked || is_link)),
+        );
+    }
+
+    if pending.is_empty()
+        && options.progress.is_none()
+        && consistency.is_none()
+        && throttle.is_none()
+        && shape.is_none()
+    {
+        return directory_sizes;
+    }
 
-        let arc_paths = Arc::new(paths);
-        let subdirectory_sizes: Vec<_> = arc_paths
+    let totals: Vec<_> = directory_sizes
+        .iter()
+        .map(|(_, size)| AtomicU64::new(*size))
+        .collect();
+    let scan = || {
+        if options.per_device {
+            devices::scan(pending, &totals, consistency, throttle, shape);
+        } else {
+            pending.into_par_iter().for_each(|(index, path, linked)| {
+                add_directory_size(
+                    &path,
+                    linked,
+                    index,
+                    &totals,
+                    consistency,
+                    shared,
+                    throttle,
+                    shape,
+                );
+            });
+        }
+        // Subtrees other processes were scanning are waited for here, on
+        // this thread rather than a pool worker, now that every claim of
+        // this scan has been finished or released.
+        let settle = |consistency| {
+            if let Some(cache) = shared {
+                cache.settle(|index, path| {
+                    add_directory_size(
+                        path,
+                        false,
+                        index,
+                        &totals,
+                        consistency,
+                        shared,
+                        throttle,
+                        shape,
+                    );
+                });
+            }
+        };
+        settle(consistency);
+        let consistency = consistency?;
+        let volatile = consistency.volatile();
+        let unsettled = options.rescan_volatile.then(|| {
+            let unsettled = consistency.rescan(&totals, |index, path, linked| {
+                add_directory_size(path, linked, index, &totals, None, shared, throttle, None);
+            });
+            settle(None);
+            unsettled
+        });
+        Some((volatile, unsettled))
+    };
+    let names: Vec<_> = directory_sizes
+        .iter()
+        .map(|(name, _)| name.clone())
+        .collect();
+    let scan = || match sinks {
+        Some(sinks) => sinks.run(&names, &totals, scan),
+        None => scan(),
+    };
+    let volatility = match options.progress {
+        Some(format) => progress::run(format, &names, &totals, scan),
+        None => scan(),
+    };
+    match volatility {
+        Some((volatile, Some(unsettled))) => eprintln!(
+            "dirsize: {volatile} directories changed during the scan; {unsettled} still inconsistent after rescanning them"
+        ),
+        Some((volatile, None)) => eprintln!("dirsize: {volatile} directories changed during the scan"),
+        None => {}
+    }
+    if let Some(throttle) = throttle {
+        throttle.report();
+    }
+    if let Some(shape) = shape {
+        shape.totals().report();
+    }
+
+    for ((_, size), total) in directory_sizes.iter_mut().zip(totals) {
+        *size = total.into_inner();
+    }
+    directory_sizes
+}
+
+/// Adds the size of `path` and everything below it to `totals[index]` one
+/// directory at a time, so the running value is always a lower bound, and
+/// returns the subtree's total. With a shared cache, subtrees another
+/// process has just scanned are taken from it instead, except at or below
+/// a symlink, and ones another process is still scanning are deferred to
+/// `SharedCache::settle`, in which case the total is `None`. With a
+/// throttle every read waits for a slot under its adaptive limit. `linked`
+/// says whether `path` was reached through a symlink.
+#[allow(clippy::too_many_arguments)]
+fn add_directory_size(
+    path: &Path,
+    mut linked: bool,
+    index: usize,
+    totals: &[AtomicU64],
+    consistency: Option<&Consistency>,
+    shared: Option<&SharedCache>,
+    throttle: Option<&Throttle>,
+    shape: Option<&Shape>,
+) -> Option<u64> {
+    let claim = match shared
+        .filter(|_| !linked)
+        .and_then(|shared| shared.claim(path))
+    {
+        Some(Claim::Reused(total)) => {
+            totals[index].fetch_add(total, Ordering::Relaxed);
+            return Some(total);
+        }
+        Some(Claim::Owned(slot)) => Some(slot),
+        Some(Claim::Busy) => {
+            shared?.defer(index, path);
+            return None;
+        }
+        Some(Claim::Linked) => {
+            linked = true;
+            None
+        }
+        None => None,
+    };
+
+    let listing = match throttle {
+        Some(throttle) => throttle.list(path),
+        None => listing::list_or_size(path),
+    };
+    if let Some(consistency) = consistency {
+        consistency.observe(index, path, linked, &listing);
+    }
+    if let Some(shape) = shape {
+        shape.record(path, &listing);
+    }
+    totals[index].fetch_add(listing.size, Ordering::Relaxed);
+    let subtree = |(position, sub_path): (usize, &PathBuf)| {
+        add_directory_size(
+            sub_path,
+            linked || listing.is_link(position),
+            index,
+            totals,
+            consistency,
+            shared,
+            throttle,
+            shape,
+        )
+    };
+    // Every subtree is walked even once one was deferred, so the totals
+    // are added without short-circuiting on `None`.
+    let add = |a: Option<u64>, b: Option<u64>| Some(a? + b?);
+    // Under memory pressure this thread walks its subdirectories itself,
+    // depth first, instead of opening more branches for others to steal.
+    let below = if memory::under_pressure() {
+        listing
+            .subdirectories
+            .iter()
+            .enumerate()
+            .map(subtree)
+            .fold(Some(0), add)
+    } else {
+        listing
+            .subdirectories
             .par_iter()
-            .filter(|sub_path| sub_path.is_dir())
-            .map(|sub_path| calculate_directory_size(sub_path))
-            .collect();
+            .enumerate()
+            .map(subtree)
+            .reduce(|| Some(0), add)
+    };
+    let total = below.map(|below| listing.size + below);
 
-        size += subdirectory_sizes.into_iter().sum::<u64>();
+    if let (Some(shared), Some(slot)) = (shared, claim) {
+        match total {
+            Some(total) => shared.finish(slot, total),
+            None => shared.release(slot),
+        }
     }
+    total
+}
 
-    size
+#[cfg(target_os = "linux")]
+fn report_capabilities() {
+    for (device, capabilities) in capabilities::probed() {
+        eprintln!(
+            "device {}: {}, d_type {}",
+            devices::device_name(device),
+            capabilities::fs_type_name(capabilities.fs_type),
+            if capabilities.trust_d_type {
+                "trusted"
+            } else {
+                "ignored"
+            }
+        );
+    }
 }
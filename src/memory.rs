@@ -0,0 +1,157 @@
+//! Memory pressure on the running scan, from the cgroup's usage against its
+//! limit or, without a limited cgroup, from the process's RSS against what
+//! the host has available. Engines check it to keep their frontier of
+//! pending directories and their output buffers small while it lasts.
+
+#[cfg(target_os = "linux")]
+use std::path::{Path, PathBuf};
+#[cfg(target_os = "linux")]
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+#[cfg(target_os = "linux")]
+use std::sync::OnceLock;
+#[cfg(target_os = "linux")]
+use std::time::{Duration, Instant};
+
+/// Usage above this fraction of the limit counts as pressure.
+#[cfg(target_os = "linux")]
+const HIGH_WATER: f64 = 0.8;
+#[cfg(target_os = "linux")]
+const SAMPLE_INTERVAL: Duration = Duration::from_millis(50);
+/// cgroup v1 reports an unlimited group as a limit near `i64::MAX`.
+#[cfg(target_os = "linux")]
+const UNLIMITED: u64 = 1 << 60;
+
+#[cfg(target_os = "linux")]
+static LIMIT: OnceLock<u64> = OnceLock::new();
+#[cfg(target_os = "linux")]
+static PRESSURE: AtomicBool = AtomicBool::new(false);
+#[cfg(target_os = "linux")]
+static REPORTED: AtomicBool = AtomicBool::new(false);
+/// Milliseconds after `epoch()` of the last sample, plus one so that zero
+/// means never sampled.
+#[cfg(target_os = "linux")]
+static SAMPLED: AtomicU64 = AtomicU64::new(0);
+
+/// Measures the process's RSS against `bytes` instead of asking the cgroup.
+#[cfg(target_os = "linux")]
+pub fn set_limit(bytes: u64) {
+    let _ = LIMIT.set(bytes);
+}
+
+/// Whether memory is tight, from a sample at most `SAMPLE_INTERVAL` old.
+/// The first time it is, says so on stderr.
+#[cfg(target_os = "linux")]
+pub fn under_pressure() -> bool {
+    let now = epoch().elapsed().as_millis() as u64 + 1;
+    let sampled = SAMPLED.load(Ordering::Relaxed);
+    // Another thread may have stored a sample taken after this `now`.
+    let due = sampled == 0 || now.saturating_sub(sampled) >= SAMPLE_INTERVAL.as_millis() as u64;
+    if due
+        && SAMPLED
+            .compare_exchange(sampled, now, Ordering::Relaxed, Ordering::Relaxed)
+            .is_ok()
+    {
+        let pressure = usage_and_limit()
+            .is_some_and(|(usage, limit)| usage as f64 > limit as f64 * HIGH_WATER);
+        PRESSURE.store(pressure, Ordering::Relaxed);
+        if pressure && !REPORTED.swap(true, Ordering::Relaxed) {
+            eprintln!("dirsize: memory is tight, scanning depth-first with small buffers");
+        }
+    }
+    PRESSURE.load(Ordering::Relaxed)
+}
+
+#[cfg(target_os = "linux")]
+fn epoch() -> Instant {
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+    *EPOCH.get_or_init(Instant::now)
+}
+
+#[cfg(target_os = "linux")]
+fn usage_and_limit() -> Option<(u64, u64)> {
+    if let Some(&limit) = LIMIT.get() {
+        return Some((rss()?, limit));
+    }
+    let (usage, limit) = cgroup_files();
+    match (
+        usage.as_deref().and_then(read_u64),
+        limit.as_deref().and_then(read_u64),
+    ) {
+        (Some(usage), Some(limit)) if limit < UNLIMITED => Some((usage, limit)),
+        _ => {
+            let rss = rss()?;
+            Some((rss, rss + available()?))
+        }
+    }
+}
+
+/// The usage and limit files of the process's memory cgroup, v2 first. The
+/// group is looked up once; only the files are read on each sample.
+#[cfg(target_os = "linux")]
+fn cgroup_files() -> (Option<PathBuf>, Option<PathBuf>) {
+    static FILES: OnceLock<(Option<PathBuf>, Option<PathBuf>)> = OnceLock::new();
+    FILES
+        .get_or_init(|| {
+            let cgroup = std::fs::read_to_string("/proc/self/cgroup").unwrap_or_default();
+            let group = |controller: &str, mount: &str| {
+                cgroup.lines().find_map(|line| {
+                    let (_, rest) = line.split_once(':')?;
+                    let (controllers, path) = rest.split_once(':')?;
+                    (controllers == controller)
+                        .then(|| Path::new(mount).join(path.trim_start_matches('/')))
+                })
+            };
+            let files = [
+                ("", "/sys/fs/cgroup", "memory.current", "memory.max"),
+                (
+                    "memory",
+                    "/sys/fs/cgroup/memory",
+                    "memory.usage_in_bytes",
+                    "memory.limit_in_bytes",
+                ),
+            ];
+            // Inside a container the group's own directory is usually the
+            // mount point rather than the path /proc/self/cgroup names.
+            files
+                .into_iter()
+                .find_map(|(controller, mount, usage, limit)| {
+                    [group(controller, mount)?, PathBuf::from(mount)]
+                        .into_iter()
+                        .find(|group| group.join(limit).exists())
+                        .map(|group| (Some(group.join(usage)), Some(group.join(limit))))
+                })
+                .unwrap_or((None, None))
+        })
+        .clone()
+}
+
+#[cfg(target_os = "linux")]
+fn read_u64(path: &Path) -> Option<u64> {
+    std::fs::read_to_string(path).ok()?.trim().parse().ok()
+}
+
+#[cfg(target_os = "linux")]
+fn rss() -> Option<u64> {
+    let statm = std::fs::read_to_string("/proc/self/statm").ok()?;
+    let pages: u64 = statm.split_whitespace().nth(1)?.parse().ok()?;
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
+    Some(pages * page_size.max(1) as u64)
+}
+
+#[cfg(target_os = "linux")]
+fn available() -> Option<u64> {
+    let meminfo = std::fs::read_to_string("/proc/meminfo").ok()?;
+    let line = meminfo
+        .lines()
+        .find(|line| line.starts_with("MemAvailable:"))?;
+    let kib: u64 = line.split_whitespace().nth(1)?.parse().ok()?;
+    Some(kib << 10)
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn set_limit(_bytes: u64) {}
+
+#[cfg(not(target_os = "linux"))]
+pub fn under_pressure() -> bool {
+    false
+}
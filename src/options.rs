@@ -0,0 +1,349 @@
+use crate::pattern;
+use crate::progress::Format;
+use std::env;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::time::Duration;
+
+const USAGE: &str = "usage: dirsize bench [--runs COUNT] [DIRECTORY]\n       dirsize compare BASELINE CURRENT\n       dirsize verify [--seed SEED | DIRECTORY]\n       dirsize query INDEX (PATH | --largest COUNT | --oldest COUNT) [--older-than DAYS]\n       dirsize refresh SNAPSHOT PATH\n       dirsize [--watch SECS] [--threshold PATH=SIZE] \
+[--inode-threshold PATH=COUNT] [--exec COMMAND] [--debounce SECS] [--churn TOP] \
+[--watch-budget COUNT] [--poll-budget COUNT] [--ttl SECS] [--per-device] [--arrow FILE] \
+[--index] [--progress text|ndjson] [--probe] [--reconcile] [--consistency] [--rescan-volatile] \
+[--shared-cache FILE] [--throttle] [--shape] [--sink (text|ndjson|prometheus|top:COUNT|arrow)=DESTINATION] [--memory-limit SIZE] [DIRECTORY | PATTERN]";
+
+#[derive(Clone, Copy)]
+pub enum Metric {
+    Bytes,
+    Inodes,
+}
+
+/// What `dirsize query` looks up in a snapshot index.
+pub enum Query {
+    Path(String),
+    Largest(usize),
+    Oldest(usize),
+}
+
+/// An extra output of the scan; see `sinks`.
+#[derive(Clone, Copy)]
+pub enum SinkKind {
+    Text,
+    Ndjson,
+    Prometheus,
+    Top(usize),
+}
+
+pub struct SinkSpec {
+    pub kind: SinkKind,
+    pub destination: PathBuf,
+}
+
+pub struct ThresholdSpec {
+    pub path: PathBuf,
+    pub metric: Metric,
+    pub limit: u64,
+}
+
+#[derive(Default)]
+pub struct Options {
+    pub root: PathBuf,
+    /// `root` is a pattern like `/home/*/.cache`; every matching directory
+    /// is sized as a top-level directory would be.
+    pub pattern: bool,
+    pub watch: Option<Duration>,
+    pub thresholds: Vec<ThresholdSpec>,
+    pub exec: Option<String>,
+    pub debounce: Duration,
+    pub churn: Option<usize>,
+    pub watch_budget: Option<usize>,
+    pub poll_budget: Option<usize>,
+    /// Age past which a `size` query in watch mode revalidates the subtree.
+    pub ttl: Option<Duration>,
+    pub per_device: bool,
+    pub arrow: Option<PathBuf>,
+    pub index: bool,
+    pub progress: Option<Format>,
+    pub probe: bool,
+    pub reconcile: bool,
+    pub consistency: bool,
+    pub rescan_volatile: bool,
+    pub shared_cache: Option<PathBuf>,
+    /// `dirsize refresh`: an Arrow snapshot and the directory in it to rescan.
+    pub refresh: Option<(PathBuf, PathBuf)>,
+    pub throttle: bool,
+    pub shape: bool,
+    pub sinks: Vec<SinkSpec>,
+    pub memory_limit: Option<u64>,
+    pub bench: bool,
+    pub runs: Option<usize>,
+    pub compare: Option<(PathBuf, PathBuf)>,
+    /// `dirsize verify`: checks the engines on `root`, or on a generated
+    /// tree when no directory was given.
+    pub verify: bool,
+    pub generate: bool,
+    pub seed: Option<u64>,
+    pub query: Option<(PathBuf, Query)>,
+    pub older_than: Option<Duration>,
+}
+
+impl Options {
+    pub fn parse() -> Options {
+        let mut options = Options {
+            root: PathBuf::from("."),
+            ..Options::default()
+        };
+
+        let mut args = env::args().skip(1).peekable();
+        if args.peek().is_some_and(|arg| arg == "bench") {
+            args.next();
+            options.bench = true;
+        } else if args.peek().is_some_and(|arg| arg == "verify") {
+            args.next();
+            options.verify = true;
+        } else if args.peek().is_some_and(|arg| arg == "compare") {
+            args.next();
+            let (Some(baseline), Some(current), None) = (args.next(), args.next(), args.next())
+            else {
+                fail("compare takes a baseline and a current results file");
+            };
+            options.compare = Some((PathBuf::from(baseline), PathBuf::from(current)));
+            return options;
+        } else if args.peek().is_some_and(|arg| arg == "refresh") {
+            args.next();
+            let (Some(snapshot), Some(path), None) = (args.next(), args.next(), args.next()) else {
+                fail("refresh takes a snapshot and a directory in it");
+            };
+            options.refresh = Some((PathBuf::from(snapshot), PathBuf::from(path)));
+            return options;
+        } else if args.peek().is_some_and(|arg| arg == "query") {
+            args.next();
+            let Some(index) = args.next() else {
+                fail("query takes an index file");
+            };
+            let mut query = None;
+            while let Some(arg) = args.next() {
+                match arg.as_str() {
+                    "--largest" => query = Some(Query::Largest(count(&value(&mut args, &arg)))),
+                    "--oldest" => query = Some(Query::Oldest(count(&value(&mut args, &arg)))),
+                    "--older-than" => {
+                        options.older_than = Some(days(&value(&mut args, &arg)));
+                    }
+                    _ if arg.starts_with('-') => fail(&format!("unknown option {arg}")),
+                    _ => query = Some(Query::Path(arg)),
+                }
+            }
+            let Some(query) = query else {
+                fail("query takes a path, --largest or --oldest");
+            };
+            options.query = Some((PathBuf::from(index), query));
+            return options;
+        }
+        let mut root = None;
+        while let Some(arg) = args.next() {
+            match arg.as_str() {
+                "--watch" => options.watch = Some(seconds(&value(&mut args, &arg))),
+                "--threshold" => options
+                    .thresholds
+                    .push(threshold(&value(&mut args, &arg), Metric::Bytes)),
+                "--inode-threshold" => options
+                    .thresholds
+                    .push(threshold(&value(&mut args, &arg), Metric::Inodes)),
+                "--exec" => options.exec = Some(value(&mut args, &arg)),
+                "--debounce" => options.debounce = seconds(&value(&mut args, &arg)),
+                "--churn" => options.churn = Some(count(&value(&mut args, &arg))),
+                "--watch-budget" => options.watch_budget = Some(count(&value(&mut args, &arg))),
+                "--poll-budget" => {
+                    options.poll_budget = match count(&value(&mut args, &arg)) {
+                        0 => fail("--poll-budget must be at least 1"),
+                        polls => Some(polls),
+                    }
+                }
+                "--ttl" => options.ttl = Some(seconds(&value(&mut args, &arg))),
+                "--runs" => {
+                    options.runs = match count(&value(&mut args, &arg)) {
+                        0 => fail("--runs must be at least 1"),
+                        runs => Some(runs),
+                    }
+                }
+                "--seed" => {
+                    let seed = value(&mut args, &arg);
+                    options.seed = Some(
+                        seed.parse()
+                            .unwrap_or_else(|_| fail(&format!("invalid seed {seed}"))),
+                    )
+                }
+                "--per-device" => options.per_device = true,
+                "--probe" => options.probe = true,
+                "--reconcile" => options.reconcile = true,
+                "--consistency" => options.consistency = true,
+                "--rescan-volatile" => {
+                    options.consistency = true;
+                    options.rescan_volatile = true;
+                }
+                "--shared-cache" => {
+                    options.shared_cache = Some(PathBuf::from(value(&mut args, &arg)))
+                }
+                "--throttle" => options.throttle = true,
+                "--shape" => options.shape = true,
+                "--sink" => {
+                    let text = value(&mut args, &arg);
+                    let Some((kind, destination)) = text.split_once('=') else {
+                        fail(&format!("expected KIND=DESTINATION, got {text}"));
+                    };
+                    let kind = match kind {
+                        "text" => SinkKind::Text,
+                        "ndjson" => SinkKind::Ndjson,
+                        "prometheus" => SinkKind::Prometheus,
+                        "arrow" => {
+                            options.arrow = Some(PathBuf::from(destination));
+                            continue;
+                        }
+                        _ => match kind.strip_prefix("top:").map(count) {
+                            Some(rows) if rows > 0 => SinkKind::Top(rows),
+                            _ => fail(&format!("unknown sink {kind}")),
+                        },
+                    };
+                    options.sinks.push(SinkSpec {
+                        kind,
+                        destination: PathBuf::from(destination),
+                    });
+                }
+                "--memory-limit" => {
+                    let limit = value(&mut args, &arg);
+                    options.memory_limit = Some(
+                        parse_size(&limit)
+                            .unwrap_or_else(|| fail(&format!("invalid memory limit {limit}"))),
+                    )
+                }
+                "--index" => options.index = true,
+                "--arrow" => options.arrow = Some(PathBuf::from(value(&mut args, &arg))),
+                "--progress" => {
+                    options.progress = Some(match value(&mut args, &arg).as_str() {
+                        "text" => Format::Text,
+                        "ndjson" => Format::Ndjson,
+                        format => fail(&format!("unknown progress format {format}")),
+                    })
+                }
+                "-h" | "--help" => {
+                    println!("{USAGE}");
+                    process::exit(0);
+                }
+                _ if arg.starts_with('-') => fail(&format!("unknown option {arg}")),
+                _ => root = Some(PathBuf::from(arg)),
+            }
+        }
+        options.generate = options.verify && root.is_none();
+        if let Some(root) = root {
+            options.root = root;
+        }
+
+        if options.watch.is_none()
+            && (!options.thresholds.is_empty()
+                || options.churn.is_some()
+                || options.poll_budget.is_some()
+                || options.ttl.is_some())
+        {
+            fail("thresholds, churn reports, poll budgets and TTLs require --watch");
+        }
+        if options.runs.is_some() && !options.bench {
+            fail("--runs only applies to dirsize bench");
+        }
+        options.pattern = pattern::is_pattern(&options.root);
+        if options.pattern
+            && (options.watch.is_some()
+                || options.arrow.is_some()
+                || options.bench
+                || options.verify
+                || options.reconcile)
+        {
+            fail("root patterns only apply to a plain scan");
+        }
+        if options.seed.is_some() && !options.generate {
+            fail("--seed only applies to dirsize verify without a directory");
+        }
+        if options.consistency && options.arrow.is_some() {
+            fail("--consistency cannot be combined with --arrow");
+        }
+        if options.shared_cache.is_some() && (options.arrow.is_some() || options.per_device) {
+            fail("--shared-cache cannot be combined with --arrow or --per-device");
+        }
+        if options.index
+            && options
+                .arrow
+                .as_deref()
+                .is_none_or(|arrow| arrow == Path::new("-"))
+        {
+            fail("--index needs --arrow with a file");
+        }
+        if options.throttle && (options.arrow.is_some() || options.watch.is_some()) {
+            fail("--throttle cannot be combined with --arrow or --watch");
+        }
+        if !options.sinks.is_empty()
+            && (options.watch.is_some() || options.arrow.as_deref() == Some(Path::new("-")))
+        {
+            fail("--sink cannot be combined with --watch or an Arrow stream on stdout");
+        }
+        if options.shape && (options.arrow.is_some() || options.watch.is_some()) {
+            fail("--shape cannot be combined with --arrow or --watch");
+        }
+        options
+    }
+}
+
+/// Parses a byte count with an optional binary suffix, e.g. `512`, `64K` or `10G`.
+pub fn parse_size(text: &str) -> Option<u64> {
+    let text = text.trim();
+    let (digits, multiplier) = match text.char_indices().last()? {
+        (i, 'K' | 'k') => (&text[..i], 1 << 10),
+        (i, 'M' | 'm') => (&text[..i], 1 << 20),
+        (i, 'G' | 'g') => (&text[..i], 1 << 30),
+        (i, 'T' | 't') => (&text[..i], 1 << 40),
+        _ => (text, 1),
+    };
+    digits.parse::<u64>().ok()?.checked_mul(multiplier)
+}
+
+fn threshold(text: &str, metric: Metric) -> ThresholdSpec {
+    let Some((path, limit)) = text.rsplit_once('=') else {
+        fail(&format!("expected PATH=LIMIT, got {text}"));
+    };
+    let Some(limit) = parse_size(limit) else {
+        fail(&format!("invalid limit {limit}"));
+    };
+    ThresholdSpec {
+        path: PathBuf::from(path),
+        metric,
+        limit,
+    }
+}
+
+fn seconds(text: &str) -> Duration {
+    match text.parse::<f64>() {
+        Ok(seconds) if seconds >= 0.0 => Duration::try_from_secs_f64(seconds)
+            .unwrap_or_else(|_| fail(&format!("invalid number of seconds {text}"))),
+        _ => fail(&format!("invalid number of seconds {text}")),
+    }
+}
+
+fn days(text: &str) -> Duration {
+    match text.parse::<f64>() {
+        Ok(days) if days >= 0.0 => Duration::try_from_secs_f64(days * 86_400.0)
+            .unwrap_or_else(|_| fail(&format!("invalid number of days {text}"))),
+        _ => fail(&format!("invalid number of days {text}")),
+    }
+}
+
+fn count(text: &str) -> usize {
+    text.parse()
+        .unwrap_or_else(|_| fail(&format!("invalid count {text}")))
+}
+
+fn value(args: &mut impl Iterator<Item = String>, option: &str) -> String {
+    args.next()
+        .unwrap_or_else(|| fail(&format!("{option} requires a value")))
+}
+
+fn fail(message: &str) -> ! {
+    eprintln!("dirsize: {message}\n{USAGE}");
+    process::exit(2);
+}
@@ -0,0 +1,207 @@
+//! Root patterns such as `/home/*/.cache`, expanded by the engine itself.
+//! Components without wildcards are joined on without reading anything,
+//! and each wildcard component lists only the directories matched so far,
+//! all of them in parallel.
+
+use crate::listing;
+use rayon::prelude::*;
+use std::ffi::OsStr;
+use std::path::{Component, Path, PathBuf};
+
+/// Whether `path` has a component with `*`, `?` or `[` in it.
+pub fn is_pattern(path: &Path) -> bool {
+    path.components()
+        .any(|component| is_wildcard(component.as_os_str()))
+}
+
+fn is_wildcard(component: &OsStr) -> bool {
+    component
+        .as_encoded_bytes()
+        .iter()
+        .any(|byte| matches!(byte, b'*' | b'?' | b'['))
+}
+
+/// Every directory matching `pattern`, sorted. As in the shell, wildcards
+/// do not match a leading dot.
+pub fn expand(pattern: &Path) -> Vec<PathBuf> {
+    let mut matched = vec![PathBuf::new()];
+    for component in pattern.components() {
+        let component = component.as_os_str();
+        matched = if is_wildcard(component) {
+            let component = component.as_encoded_bytes();
+            matched
+                .par_iter()
+                .flat_map_iter(|directory| {
+                    // A relative pattern starts from the current directory
+                    // but yields paths as the user wrote them, without `./`.
+                    let listed = if directory.as_os_str().is_empty() {
+                        listing::list(Path::new(Component::CurDir.as_os_str()))
+                    } else {
+                        listing::list(directory)
+                    };
+                    listed
+                        .map(|listing| listing.subdirectories)
+                        .unwrap_or_default()
+                        .into_iter()
+                        .filter_map(move |sub_path| {
+                            let name = sub_path.file_name()?;
+                            let bytes = name.as_encoded_bytes();
+                            let visible =
+                                bytes.first() != Some(&b'.') || component.first() == Some(&b'.');
+                            (visible && matches(component, bytes)).then(|| directory.join(name))
+                        })
+                })
+                .collect()
+        } else {
+            matched
+                .into_iter()
+                .map(|directory| directory.join(component))
+                .collect()
+        };
+    }
+    matched.retain(|path| path.is_dir());
+    matched.sort();
+    matched
+}
+
+/// Glob match of one name: `*` is any run of bytes, `?` any one byte and
+/// `[abc]`, `[a-z]` or `[!a-z]` one byte from a set. Every other token takes
+/// exactly one byte, so on a mismatch it is enough to let the last `*` take
+/// one more byte and go on from there, which keeps this O(pattern × name).
+fn matches(pattern: &[u8], name: &[u8]) -> bool {
+    let (mut pattern_at, mut name_at) = (0, 0);
+    // The pattern after the last `*` and where in the name it resumes.
+    let mut star = None;
+    while name_at < name.len() {
+        if pattern.get(pattern_at) == Some(&b'*') {
+            pattern_at += 1;
+            star = Some((pattern_at, name_at));
+            continue;
+        }
+        if let Some((true, length)) =
+            (pattern_at < pattern.len()).then(|| token(&pattern[pattern_at..], name[name_at]))
+        {
+            pattern_at += length;
+            name_at += 1;
+            continue;
+        }
+        let Some((after, resume)) = star else {
+            return false;
+        };
+        pattern_at = after;
+        name_at = resume + 1;
+        star = Some((after, name_at));
+    }
+    pattern[pattern_at..].iter().all(|&byte| byte == b'*')
+}
+
+/// Whether the token at the start of `pattern`, which is not `*`, matches
+/// `byte`, and how long the token is.
+fn token(pattern: &[u8], byte: u8) -> (bool, usize) {
+    match pattern[0] {
+        b'?' => (true, 1),
+        b'[' => match class(&pattern[1..]) {
+            Some((in_class, rest)) => (in_class(byte), pattern.len() - rest.len()),
+            // An unclosed `[` is an ordinary character.
+            None => (byte == b'[', 1),
+        },
+        literal => (byte == literal, 1),
+    }
+}
+
+/// Parses a class after its `[`, returning its test and the rest of the
+/// pattern after the closing `]`.
+fn class(pattern: &[u8]) -> Option<(impl Fn(u8) -> bool + '_, &[u8])> {
+    let (negated, body) = match pattern.first() {
+        Some(b'!' | b'^') => (true, &pattern[1..]),
+        _ => (false, pattern),
+    };
+    // A `]` right after the opening bracket is part of the set.
+    let close = 1 + body.get(1..)?.iter().position(|&byte| byte == b']')?;
+    let (set, rest) = (&body[..close], &body[close + 1..]);
+    let in_class = move |byte: u8| {
+        let mut found = false;
+        let mut position = 0;
+        while position < set.len() {
+            if position + 2 < set.len() && set[position + 1] == b'-' {
+                found |= (set[position]..=set[position + 2]).contains(&byte);
+                position += 3;
+            } else {
+                found |= set[position] == byte;
+                position += 1;
+            }
+        }
+        found != negated
+    };
+    Some((in_class, rest))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::matches;
+
+    fn glob(pattern: &str, name: &str) -> bool {
+        matches(pattern.as_bytes(), name.as_bytes())
+    }
+
+    #[test]
+    fn star() {
+        assert!(glob("*", ""));
+        assert!(glob("*", "cache"));
+        assert!(glob("*.log", "app.log"));
+        assert!(glob("a*b*c", "aXbYbZc"));
+        assert!(glob("**a", "bba"));
+        assert!(!glob("*.log", "app.log.1"));
+        assert!(!glob("a*b", "acb-"));
+    }
+
+    #[test]
+    fn question_mark() {
+        assert!(glob("?", "x"));
+        assert!(glob("d?", "d1"));
+        assert!(glob("?*?", "ab"));
+        assert!(!glob("?", ""));
+        assert!(!glob("d?", "d12"));
+    }
+
+    #[test]
+    fn classes() {
+        assert!(glob("[abc]", "b"));
+        assert!(glob("d[0-9]", "d7"));
+        assert!(glob("[a-cx-z]*", "yes"));
+        assert!(glob("[]x]", "]"));
+        assert!(!glob("[abc]", "d"));
+        assert!(!glob("d[0-9]", "dx"));
+        assert!(!glob("[a-c]", ""));
+    }
+
+    #[test]
+    fn negated_classes() {
+        assert!(glob("[!a-c]", "d"));
+        assert!(glob("[^0-9]x", "ax"));
+        assert!(!glob("[!a-c]", "b"));
+        assert!(!glob("[^0-9]x", "5x"));
+    }
+
+    #[test]
+    fn unclosed_bracket_is_literal() {
+        assert!(glob("[ab", "[ab"));
+        assert!(glob("*[", "x["));
+        assert!(!glob("[ab", "a"));
+    }
+
+    #[test]
+    fn no_match() {
+        assert!(!glob("", "a"));
+        assert!(!glob("a", ""));
+        assert!(!glob("abc", "abd"));
+        assert!(!glob("a*", "ba"));
+    }
+
+    #[test]
+    fn many_stars_do_not_backtrack_exponentially() {
+        let name = "a".repeat(64);
+        assert!(!glob(&format!("{}b", "a*".repeat(32)), &name));
+        assert!(glob(&"*a".repeat(32), &name));
+    }
+}
@@ -0,0 +1,126 @@
+use crate::watch::json_string;
+use std::io::{self, IsTerminal, Write};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+const INTERVAL: Duration = Duration::from_millis(200);
+/// How often the text display prints when stderr is not a terminal.
+const PLAIN_INTERVAL: Duration = Duration::from_secs(5);
+
+/// Rows kept on screen by the text display, largest first.
+const TEXT_ROWS: usize = 20;
+
+#[derive(Clone, Copy, PartialEq)]
+pub enum Format {
+    Text,
+    Ndjson,
+}
+
+/// Runs `scan` while reporting the live totals it accumulates. Every value
+/// shown before the scan finishes is a lower bound. Text redraws a block
+/// on stderr in place, or prints the changed totals as plain lines every
+/// few seconds when stderr is not a terminal; NDJSON prints one line per
+/// changed total on stdout and finishes with a `final` line per directory.
+pub fn run<R: Send>(
+    format: Format,
+    names: &[String],
+    totals: &[AtomicU64],
+    scan: impl FnOnce() -> R + Send,
+) -> R {
+    let done = AtomicBool::new(false);
+    let mut last = vec![None; totals.len()];
+    let mut drawn = 0;
+    let live = io::stderr().is_terminal();
+    let mut printed = Instant::now();
+
+    let reporter = thread::current();
+    let result = thread::scope(|scope| {
+        let scanner = scope.spawn(|| {
+            let result = scan();
+            done.store(true, Ordering::Release);
+            reporter.unpark();
+            result
+        });
+        while !done.load(Ordering::Acquire) {
+            match format {
+                Format::Text if live => drawn = draw(names, totals, drawn),
+                Format::Text => {
+                    if printed.elapsed() >= PLAIN_INTERVAL {
+                        print_changed(names, totals, &mut last);
+                        printed = Instant::now();
+                    }
+                }
+                Format::Ndjson => emit(names, totals, &mut last, false),
+            }
+            thread::park_timeout(INTERVAL);
+        }
+        scanner.join().unwrap()
+    });
+
+    match format {
+        Format::Text => clear(drawn),
+        Format::Ndjson => emit(names, totals, &mut vec![None; totals.len()], true),
+    }
+    result
+}
+
+fn emit(names: &[String], totals: &[AtomicU64], last: &mut [Option<u64>], done: bool) {
+    let mut out = io::stdout().lock();
+    for (index, total) in totals.iter().enumerate() {
+        let size = total.load(Ordering::Relaxed);
+        if last[index] != Some(size) {
+            last[index] = Some(size);
+            writeln!(
+                out,
+                "{{\"event\":\"progress\",\"path\":{},\"size\":{size},\"final\":{done}}}",
+                json_string(&names[index])
+            )
+            .unwrap();
+        }
+    }
+    out.flush().unwrap();
+}
+
+fn print_changed(names: &[String], totals: &[AtomicU64], last: &mut [Option<u64>]) {
+    let mut rows: Vec<_> = totals
+        .iter()
+        .map(|total| total.load(Ordering::Relaxed))
+        .enumerate()
+        .filter(|&(index, size)| last[index] != Some(size))
+        .collect();
+    rows.sort_by(|a, b| b.1.cmp(&a.1));
+    rows.truncate(TEXT_ROWS);
+
+    let mut err = io::stderr().lock();
+    for (index, size) in rows {
+        last[index] = Some(size);
+        writeln!(err, "{}: >= {size} bytes", names[index]).unwrap();
+    }
+}
+
+fn draw(names: &[String], totals: &[AtomicU64], drawn: usize) -> usize {
+    let mut rows: Vec<_> = totals
+        .iter()
+        .map(|total| total.load(Ordering::Relaxed))
+        .enumerate()
+        .collect();
+    rows.sort_by(|a, b| b.1.cmp(&a.1));
+    rows.truncate(TEXT_ROWS);
+
+    let mut err = io::stderr().lock();
+    if drawn > 0 {
+        write!(err, "\x1b[{drawn}A").unwrap();
+    }
+    for (index, size) in &rows {
+        writeln!(err, "\x1b[2K{}: >= {size} bytes", names[*index]).unwrap();
+    }
+    err.flush().unwrap();
+    rows.len()
+}
+
+fn clear(drawn: usize) {
+    if drawn > 0 {
+        eprint!("\x1b[{drawn}A\x1b[J");
+    }
+}
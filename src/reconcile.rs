@@ -0,0 +1,250 @@
+use crate::capabilities::fs_type_name;
+use crate::devices::device_name;
+use rayon::prelude::*;
+use std::collections::{HashMap, HashSet};
+use std::ffi::CString;
+use std::fs::{self, Metadata};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+
+/// Processes listed per mount before the rest are summed up.
+const TOP_PROCESSES: usize = 10;
+
+struct Mount {
+    device: u64,
+    point: PathBuf,
+}
+
+#[derive(Default)]
+struct Usage {
+    bytes: AtomicU64,
+    unreadable: AtomicU64,
+    hardlinks: Mutex<HashSet<u64>>,
+}
+
+/// A deleted file that some process still holds open.
+struct Held {
+    device: u64,
+    inode: u64,
+    bytes: u64,
+    pid: u32,
+}
+
+/// Explains "df says full but du says half": for every mount at or below
+/// `root`, compares the space the filesystem reports as used with the space
+/// reachable by walking it, and attributes the gap to deleted files that
+/// are still held open.
+pub fn run(root: &Path) {
+    let root = fs::canonicalize(root).unwrap();
+    let mounts = mounts(&root);
+    let held = held_open();
+
+    for mount in mounts {
+        let Some((fs_type, used)) = filesystem_usage(&mount.point) else {
+            continue;
+        };
+
+        let usage = Usage::default();
+        let metadata = fs::symlink_metadata(&mount.point).unwrap();
+        usage.bytes.store(disk_usage(&metadata), Ordering::Relaxed);
+        walk(&mount.point, mount.device, &usage);
+        let scanned = usage.bytes.into_inner();
+
+        let mut files = HashSet::new();
+        let mut deleted = 0;
+        let mut by_process: HashMap<u32, (u64, u64)> = HashMap::new();
+        for held in held.iter().filter(|held| held.device == mount.device) {
+            if files.insert(held.inode) {
+                deleted += held.bytes;
+            }
+            let process = by_process.entry(held.pid).or_default();
+            process.0 += held.bytes;
+            process.1 += 1;
+        }
+
+        println!(
+            "{} ({}, {})",
+            mount.point.display(),
+            fs_type_name(fs_type),
+            device_name(mount.device)
+        );
+        println!("  filesystem used:  {used} bytes");
+        println!("  scanned:          {scanned} bytes");
+        println!("  difference:       {} bytes", used as i64 - scanned as i64);
+        println!(
+            "  deleted but open: {deleted} bytes in {} files",
+            files.len()
+        );
+
+        let mut by_process: Vec<_> = by_process.into_iter().collect();
+        by_process.sort_by(|a, b| b.1 .0.cmp(&a.1 .0));
+        for (pid, (bytes, count)) in by_process.iter().take(TOP_PROCESSES) {
+            println!(
+                "    pid {pid} ({}): {bytes} bytes in {count} files",
+                command(*pid)
+            );
+        }
+        if by_process.len() > TOP_PROCESSES {
+            let rest: u64 = by_process[TOP_PROCESSES..]
+                .iter()
+                .map(|(_, (bytes, _))| bytes)
+                .sum();
+            println!(
+                "    {} more processes: {rest} bytes",
+                by_process.len() - TOP_PROCESSES
+            );
+        }
+
+        let unreadable = usage.unreadable.into_inner();
+        if unreadable > 0 {
+            println!("  unreadable directories: {unreadable} (their contents are not in the scan)");
+        }
+    }
+}
+
+/// Mounts whose mount point is `root`, lies below it, or contains it.
+fn mounts(root: &Path) -> Vec<Mount> {
+    let root_device = fs::metadata(root).unwrap().dev();
+    let mountinfo = fs::read_to_string("/proc/self/mountinfo").unwrap();
+
+    let mut containing: Option<Mount> = None;
+    let mut below = Vec::new();
+    for line in mountinfo.lines() {
+        let fields: Vec<_> = line.split(' ').collect();
+        if fields.len() < 5 {
+            continue;
+        }
+        let Some((major, minor)) = fields[2].split_once(':') else {
+            continue;
+        };
+        let (Ok(major), Ok(minor)) = (major.parse(), minor.parse()) else {
+            continue;
+        };
+        let mount = Mount {
+            device: libc::makedev(major, minor),
+            point: PathBuf::from(unescape(fields[4])),
+        };
+
+        if mount.point != root && mount.point.starts_with(root) {
+            below.push(mount);
+        } else if mount.device == root_device
+            && root.starts_with(&mount.point)
+            && containing
+                .as_ref()
+                .is_none_or(|current| mount.point.starts_with(&current.point))
+        {
+            containing = Some(mount);
+        }
+    }
+
+    containing.into_iter().chain(below).collect()
+}
+
+/// Mount points in mountinfo escape spaces and a few other bytes as octal.
+fn unescape(field: &str) -> String {
+    let mut unescaped = Vec::new();
+    let bytes = field.as_bytes();
+    let mut i = 0;
+    while i < bytes.len() {
+        match u8::from_str_radix(field.get(i + 1..i + 4).unwrap_or(""), 8) {
+            Ok(byte) if bytes[i] == b'\\' => {
+                unescaped.push(byte);
+                i += 4;
+            }
+            _ => {
+                unescaped.push(bytes[i]);
+                i += 1;
+            }
+        }
+    }
+    String::from_utf8_lossy(&unescaped).into_owned()
+}
+
+/// Filesystem type and used bytes. Pseudo filesystems report no blocks and
+/// are skipped.
+fn filesystem_usage(point: &Path) -> Option<(i64, u64)> {
+    let path = CString::new(point.as_os_str().as_bytes()).ok()?;
+    let mut statfs: libc::statfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statfs(path.as_ptr(), &mut statfs) } != 0 || statfs.f_blocks == 0 {
+        return None;
+    }
+    #[allow(clippy::unnecessary_cast)]
+    let used = (statfs.f_blocks - statfs.f_bfree) as u64 * statfs.f_frsize as u64;
+    #[allow(clippy::unnecessary_cast)]
+    Some((statfs.f_type as i64, used))
+}
+
+fn disk_usage(metadata: &Metadata) -> u64 {
+    metadata.blocks() * 512
+}
+
+/// Adds the allocated size of everything below `path` that lives on
+/// `device`, counting hard-linked files once.
+fn walk(path: &Path, device: u64, usage: &Usage) {
+    let Ok(read_dir) = fs::read_dir(path) else {
+        usage.unreadable.fetch_add(1, Ordering::Relaxed);
+        return;
+    };
+
+    let mut subdirectories = Vec::new();
+    let mut bytes = 0;
+    for entry in read_dir.flatten() {
+        let Ok(metadata) = entry.metadata() else {
+            continue;
+        };
+        if metadata.dev() != device {
+            continue;
+        }
+        if metadata.is_dir() {
+            subdirectories.push(entry.path());
+        } else if metadata.nlink() > 1 && !usage.hardlinks.lock().unwrap().insert(metadata.ino()) {
+            continue;
+        }
+        bytes += disk_usage(&metadata);
+    }
+    usage.bytes.fetch_add(bytes, Ordering::Relaxed);
+
+    subdirectories
+        .par_iter()
+        .for_each(|sub_path| walk(sub_path, device, usage));
+}
+
+/// Every deleted file held open by any process, found by reading
+/// `/proc/<pid>/fd` for all processes in parallel.
+fn held_open() -> Vec<Held> {
+    let pids: Vec<u32> = fs::read_dir("/proc")
+        .unwrap()
+        .flatten()
+        .filter_map(|entry| entry.file_name().to_str()?.parse().ok())
+        .collect();
+
+    pids.par_iter()
+        .flat_map_iter(|&pid| {
+            let fds = fs::read_dir(format!("/proc/{pid}/fd"))
+                .into_iter()
+                .flatten();
+            fds.flatten().filter_map(move |fd| {
+                let target = fs::read_link(fd.path()).ok()?;
+                if !target.as_os_str().as_bytes().ends_with(b" (deleted)") {
+                    return None;
+                }
+                let metadata = fs::metadata(fd.path()).ok()?;
+                (metadata.is_file() && metadata.nlink() == 0).then(|| Held {
+                    device: metadata.dev(),
+                    inode: metadata.ino(),
+                    bytes: disk_usage(&metadata),
+                    pid,
+                })
+            })
+        })
+        .collect()
+}
+
+fn command(pid: u32) -> String {
+    fs::read_to_string(format!("/proc/{pid}/comm"))
+        .map(|command| command.trim_end().to_owned())
+        .unwrap_or_else(|_| "?".to_owned())
+}
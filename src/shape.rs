@@ -0,0 +1,135 @@
+//! The shape of a scanned tree: how many entries directories have, how
+//! deep they sit and where the bytes are by depth. Each scan thread counts
+//! into its own fixed arrays of buckets, merged when the report is made.
+
+use crate::listing::Listing;
+use std::path::Path;
+use std::sync::Mutex;
+
+/// Bucket 0 counts empty directories and bucket `b` directories with
+/// 2^(b-1) to 2^b - 1 entries; the last one takes everything larger.
+const FANOUT_BUCKETS: usize = 24;
+/// Depth 1 is a top-level directory; the last bucket takes anything deeper.
+const DEPTH_BUCKETS: usize = 64;
+
+#[derive(Clone)]
+pub struct Buckets {
+    fanout: [u64; FANOUT_BUCKETS],
+    directories: [u64; DEPTH_BUCKETS],
+    bytes: [u64; DEPTH_BUCKETS],
+}
+
+impl Default for Buckets {
+    fn default() -> Buckets {
+        Buckets {
+            fanout: [0; FANOUT_BUCKETS],
+            directories: [0; DEPTH_BUCKETS],
+            bytes: [0; DEPTH_BUCKETS],
+        }
+    }
+}
+
+impl Buckets {
+    pub fn record(&mut self, depth: usize, entries: u64, size: u64) {
+        let fanout = (u64::BITS - entries.leading_zeros()) as usize;
+        let depth = depth.min(DEPTH_BUCKETS - 1);
+        self.fanout[fanout.min(FANOUT_BUCKETS - 1)] += 1;
+        self.directories[depth] += 1;
+        self.bytes[depth] += size;
+    }
+
+    fn merge(&mut self, other: &Buckets) {
+        for (total, count) in self.fanout.iter_mut().zip(other.fanout) {
+            *total += count;
+        }
+        for (total, count) in self.directories.iter_mut().zip(other.directories) {
+            *total += count;
+        }
+        for (total, bytes) in self.bytes.iter_mut().zip(other.bytes) {
+            *total += bytes;
+        }
+    }
+
+    /// Buckets up to the last non-empty one.
+    fn used(counts: &[u64]) -> &[u64] {
+        let used = counts
+            .iter()
+            .rposition(|&count| count > 0)
+            .map_or(0, |last| last + 1);
+        &counts[..used]
+    }
+
+    /// Prints the histograms to stderr.
+    pub fn report(&self) {
+        let directories: u64 = self.directories.iter().sum();
+        let deepest = Buckets::used(&self.directories).len().saturating_sub(1);
+        eprintln!("shape: {directories} directories, deepest at depth {deepest}");
+        eprintln!("entries per directory:");
+        for (bucket, &count) in Buckets::used(&self.fanout).iter().enumerate() {
+            let range = match bucket {
+                0 => "0".to_owned(),
+                1 => "1".to_owned(),
+                _ if bucket == FANOUT_BUCKETS - 1 => format!("{}+", 1u64 << (bucket - 1)),
+                _ => format!("{}-{}", 1u64 << (bucket - 1), (1u64 << bucket) - 1),
+            };
+            eprintln!("  {range:>15}: {count}");
+        }
+        eprintln!("depth: directories, bytes");
+        let used = Buckets::used(&self.directories);
+        for (depth, (&count, &bytes)) in used.iter().zip(&self.bytes).enumerate().skip(1) {
+            eprintln!("  {depth:>5}: {count}, {bytes}");
+        }
+    }
+
+    /// The histograms as JSON fields, for NDJSON output.
+    pub fn json_fields(&self) -> String {
+        let array = |counts: &[u64]| {
+            let counts: Vec<_> = counts.iter().map(u64::to_string).collect();
+            format!("[{}]", counts.join(","))
+        };
+        let depths = Buckets::used(&self.directories).len();
+        format!(
+            "\"fanout_log2\":{},\"directories_by_depth\":{},\"bytes_by_depth\":{}",
+            array(Buckets::used(&self.fanout)),
+            array(&self.directories[..depths]),
+            array(&self.bytes[..depths])
+        )
+    }
+}
+
+/// Shape counters for one scan, sharded by rayon thread so that workers
+/// never wait on each other. Threads outside the pool share shard 0.
+pub struct Shape {
+    base: usize,
+    shards: Vec<Mutex<Buckets>>,
+}
+
+impl Shape {
+    /// Counts depths so that directories like `top_level`, which must be
+    /// one of the scan's top-level directories, sit at depth 1.
+    pub fn new(top_level: &Path) -> Shape {
+        Shape {
+            base: top_level.components().count().saturating_sub(1),
+            shards: (0..=rayon::current_num_threads())
+                .map(|_| Mutex::new(Buckets::default()))
+                .collect(),
+        }
+    }
+
+    pub fn record(&self, path: &Path, listing: &Listing) {
+        let shard = rayon::current_thread_index().map_or(0, |index| index + 1);
+        let depth = path.components().count().saturating_sub(self.base);
+        self.shards[shard % self.shards.len()]
+            .lock()
+            .unwrap()
+            .record(depth, listing.entries, listing.size);
+    }
+
+    pub fn totals(&self) -> Buckets {
+        let mut totals = Buckets::default();
+        for shard in &self.shards {
+            totals.merge(&shard.lock().unwrap());
+        }
+        totals
+    }
+}
@@ -0,0 +1,384 @@
+//! Subtree totals shared between dirsize processes on one host through a
+//! memory-mapped file, so concurrent jobs over overlapping trees read each
+//! directory once between them.
+//!
+//! The file is a header slot followed by an open-addressing table of
+//! 64-byte slots keyed by a hash of the directory's `st_dev` and `st_ino`.
+//! A process claims a slot before scanning the subtree and publishes the
+//! total when done; others reuse that total for a while instead of scanning
+//! the same subtree. Totals are written under a sequence counter, so
+//! readers never take a lock. Once the slots around a key are all taken,
+//! one whose total is too old to reuse, or whose owner has died, is taken
+//! over for it.
+//!
+//! A subtree another live process is still scanning is deferred: the scan
+//! goes on with the rest, gives up its claims above the deferred subtree
+//! instead of publishing partial totals, and waits for it only once its
+//! own work is done. Waiting happens outside the thread pool while holding
+//! no claims, so two processes can never wait on each other.
+
+use std::io;
+use std::path::{Path, PathBuf};
+#[cfg(target_os = "linux")]
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Mutex;
+#[cfg(target_os = "linux")]
+use std::time::Duration;
+
+/// Slots in a new cache file, 4 MiB in total.
+#[cfg(target_os = "linux")]
+const SLOTS: usize = 1 << 16;
+#[cfg(target_os = "linux")]
+const WORDS_PER_SLOT: usize = 8;
+/// Slots tried after the home slot of a key before giving up on sharing it.
+#[cfg(target_os = "linux")]
+const PROBE_LIMIT: usize = 32;
+#[cfg(target_os = "linux")]
+const MAGIC: u64 = u64::from_le_bytes(*b"DIRSIZE1");
+
+/// Finished totals younger than this are reused rather than rescanned.
+#[cfg(target_os = "linux")]
+const REUSE_AGE: Duration = Duration::from_secs(60);
+/// How often a deferred subtree's slot is checked while waiting for it.
+#[cfg(target_os = "linux")]
+const WAIT_INTERVAL: Duration = Duration::from_millis(20);
+
+// Words of a slot. `state` is the owner's pid shifted left by two with one
+// of the tags below in the low bits.
+#[cfg(target_os = "linux")]
+const KEY: usize = 0;
+#[cfg(target_os = "linux")]
+const STATE: usize = 1;
+#[cfg(target_os = "linux")]
+const SEQUENCE: usize = 2;
+#[cfg(target_os = "linux")]
+const TOTAL: usize = 3;
+#[cfg(target_os = "linux")]
+const FINISHED: usize = 4;
+
+#[cfg(target_os = "linux")]
+const CLAIMED: u64 = 1;
+#[cfg(target_os = "linux")]
+const DONE: u64 = 2;
+
+pub enum Claim {
+    /// Another process has a recent total for this subtree.
+    Reused(u64),
+    /// This process now owns the subtree and must `finish` or `release` it.
+    Owned(usize),
+    /// Another live process, or another thread of this one, is scanning
+    /// the subtree. `defer` it rather than scanning it too.
+    Busy,
+    /// `path` is a symlink. Nothing below it is shared: how far a scan gets
+    /// into a symlink loop depends on how many links the path has already
+    /// followed, so totals there are not a property of the directory.
+    Linked,
+}
+
+pub struct SharedCache {
+    #[cfg(target_os = "linux")]
+    words: &'static [AtomicU64],
+    /// Busy subtrees with the root index their totals belong to.
+    deferred: Mutex<Vec<(usize, PathBuf)>>,
+}
+
+impl SharedCache {
+    /// Leaves the subtree at `path`, found `Busy`, to `settle`.
+    pub fn defer(&self, index: usize, path: &Path) {
+        self.deferred.lock().unwrap().push((index, path.to_owned()));
+    }
+
+    /// Waits for each deferred subtree until no live process is scanning
+    /// it any more, then hands it to `scan`, which claims it again and
+    /// either reuses the published total or scans the subtree itself if its
+    /// owner gave up or died. Subtrees deferred again meanwhile are waited
+    /// for in turn. Call this on a thread outside the pool, between scans,
+    /// so that this process holds no claims while it waits.
+    pub fn settle(&self, scan: impl Fn(usize, &Path)) {
+        loop {
+            let deferred = std::mem::take(&mut *self.deferred.lock().unwrap());
+            if deferred.is_empty() {
+                return;
+            }
+            for (index, path) in deferred {
+                self.wait(&path);
+                scan(index, &path);
+            }
+        }
+    }
+}
+
+#[cfg(target_os = "linux")]
+impl SharedCache {
+    /// Maps `path`, creating and sizing it if needed. The mapping lives for
+    /// the rest of the process.
+    pub fn open(path: &Path) -> io::Result<SharedCache> {
+        use std::fs::OpenOptions;
+        use std::os::fd::AsRawFd;
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(path)?;
+        let length = ((1 + SLOTS) * WORDS_PER_SLOT * 8) as u64;
+        if file.metadata()?.len() < length {
+            file.set_len(length)?;
+        }
+        let length = file.metadata()?.len() as usize;
+
+        let address = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                length,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if address == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        let words = unsafe { std::slice::from_raw_parts(address.cast::<AtomicU64>(), length / 8) };
+
+        match words[0].compare_exchange(0, MAGIC, Ordering::AcqRel, Ordering::Acquire) {
+            Ok(_) | Err(MAGIC) => Ok(SharedCache {
+                words,
+                deferred: Mutex::new(Vec::new()),
+            }),
+            Err(_) => Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "not a dirsize shared cache",
+            )),
+        }
+    }
+
+    fn slot_count(&self) -> usize {
+        self.words.len() / WORDS_PER_SLOT - 1
+    }
+
+    fn word(&self, slot: usize, word: usize) -> &AtomicU64 {
+        &self.words[(1 + slot) * WORDS_PER_SLOT + word]
+    }
+
+    /// Finds or claims the slot for the directory at `path`. Returns `None`
+    /// when the subtree should be scanned without sharing. Never waits: this
+    /// runs on pool threads that may hold claims of their own above stolen
+    /// work, so waiting here could leave two processes waiting on each
+    /// other.
+    pub fn claim(&self, path: &Path) -> Option<Claim> {
+        use std::os::unix::fs::MetadataExt;
+
+        let metadata = std::fs::symlink_metadata(path).ok()?;
+        if metadata.file_type().is_symlink() {
+            return Some(Claim::Linked);
+        }
+        if !metadata.is_dir() {
+            return None;
+        }
+        let key = key(metadata.dev(), metadata.ino());
+        let me = (std::process::id() as u64) << 2;
+
+        let home = key as usize % self.slot_count();
+        let mut reclaimable = None;
+        for step in 0..PROBE_LIMIT {
+            let slot = (home + step) % self.slot_count();
+            let current = match self.word(slot, KEY).compare_exchange(
+                0,
+                key,
+                Ordering::AcqRel,
+                Ordering::Acquire,
+            ) {
+                Ok(_) => key,
+                Err(current) => current,
+            };
+            if current == key {
+                return self.claim_slot(slot, key, me);
+            }
+            if reclaimable.is_none() {
+                let state = self.word(slot, STATE).load(Ordering::Acquire);
+                if self.is_reclaimable(slot, state) {
+                    reclaimable = Some((slot, state));
+                }
+            }
+        }
+
+        // The state is taken before the key is changed, so a process still
+        // claiming the slot under its old key sees it busy or rekeyed.
+        let taken = reclaimable.filter(|&(slot, state)| {
+            self.word(slot, STATE)
+                .compare_exchange(state, me | CLAIMED, Ordering::AcqRel, Ordering::Acquire)
+                .is_ok()
+        });
+        match taken {
+            Some((slot, _)) => {
+                self.word(slot, KEY).store(key, Ordering::Release);
+                Some(Claim::Owned(slot))
+            }
+            None => {
+                static REPORTED: AtomicBool = AtomicBool::new(false);
+                if !REPORTED.swap(true, Ordering::Relaxed) {
+                    eprintln!("dirsize: shared cache is full, scanning some subtrees unshared");
+                }
+                None
+            }
+        }
+    }
+
+    /// Reuses or claims `slot`, found holding `key`.
+    fn claim_slot(&self, slot: usize, key: u64, me: u64) -> Option<Claim> {
+        loop {
+            let state = self.word(slot, STATE).load(Ordering::Acquire);
+            if state & DONE != 0 {
+                let (total, finished) = self.read(slot);
+                // Taken over for another directory since it was found.
+                if self.word(slot, KEY).load(Ordering::Acquire) != key {
+                    return None;
+                }
+                if now().saturating_sub(finished) < REUSE_AGE.as_secs() {
+                    return Some(Claim::Reused(total));
+                }
+            } else if state & CLAIMED != 0 && alive((state >> 2) as libc::pid_t) {
+                return Some(Claim::Busy);
+            }
+            let claimed = self.word(slot, STATE).compare_exchange(
+                state,
+                me | CLAIMED,
+                Ordering::AcqRel,
+                Ordering::Acquire,
+            );
+            if claimed.is_ok() {
+                if self.word(slot, KEY).load(Ordering::Acquire) == key {
+                    return Some(Claim::Owned(slot));
+                }
+                self.word(slot, STATE).store(state, Ordering::Release);
+                return None;
+            }
+        }
+    }
+
+    /// Blocks while a live process holds the claim on the directory at
+    /// `path`.
+    fn wait(&self, path: &Path) {
+        use std::os::unix::fs::MetadataExt;
+
+        let Ok(metadata) = std::fs::symlink_metadata(path) else {
+            return;
+        };
+        let key = key(metadata.dev(), metadata.ino());
+        let home = key as usize % self.slot_count();
+        let slot = (0..PROBE_LIMIT)
+            .map(|step| (home + step) % self.slot_count())
+            .find(|&slot| self.word(slot, KEY).load(Ordering::Acquire) == key);
+        let Some(slot) = slot else {
+            return;
+        };
+        loop {
+            let state = self.word(slot, STATE).load(Ordering::Acquire);
+            let busy = state & CLAIMED != 0 && alive((state >> 2) as libc::pid_t);
+            if !busy || self.word(slot, KEY).load(Ordering::Acquire) != key {
+                return;
+            }
+            std::thread::sleep(WAIT_INTERVAL);
+        }
+    }
+
+    /// Whether a slot in `state` can be taken over for another directory:
+    /// its total is too old to reuse, its owner died while scanning, or it
+    /// was keyed and never claimed.
+    fn is_reclaimable(&self, slot: usize, state: u64) -> bool {
+        if state & DONE != 0 {
+            let finished = self.word(slot, FINISHED).load(Ordering::Acquire);
+            now().saturating_sub(finished) >= REUSE_AGE.as_secs()
+        } else if state & CLAIMED != 0 {
+            !alive((state >> 2) as libc::pid_t)
+        } else {
+            true
+        }
+    }
+
+    /// Seqlock read of a slot's total and finish time.
+    fn read(&self, slot: usize) -> (u64, u64) {
+        loop {
+            let before = self.word(slot, SEQUENCE).load(Ordering::Acquire);
+            if before % 2 == 1 {
+                std::hint::spin_loop();
+                continue;
+            }
+            let total = self.word(slot, TOTAL).load(Ordering::Acquire);
+            let finished = self.word(slot, FINISHED).load(Ordering::Acquire);
+            if self.word(slot, SEQUENCE).load(Ordering::Acquire) == before {
+                return (total, finished);
+            }
+        }
+    }
+
+    /// Publishes the total of a subtree claimed with `claim`.
+    pub fn finish(&self, slot: usize, total: u64) {
+        let sequence = self.word(slot, SEQUENCE);
+        sequence.fetch_add(1, Ordering::AcqRel);
+        self.word(slot, TOTAL).store(total, Ordering::Release);
+        self.word(slot, FINISHED).store(now(), Ordering::Release);
+        sequence.fetch_add(1, Ordering::AcqRel);
+        let me = (std::process::id() as u64) << 2;
+        self.word(slot, STATE).store(me | DONE, Ordering::Release);
+    }
+
+    /// Gives up a claim without publishing a total, for a subtree part of
+    /// which was deferred. Whoever claims it next scans it.
+    pub fn release(&self, slot: usize) {
+        let me = (std::process::id() as u64) << 2;
+        let _ = self.word(slot, STATE).compare_exchange(
+            me | CLAIMED,
+            0,
+            Ordering::AcqRel,
+            Ordering::Acquire,
+        );
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn key(device: u64, inode: u64) -> u64 {
+    let mut key = device.wrapping_mul(0x9e37_79b9_7f4a_7c15) ^ inode;
+    key ^= key >> 33;
+    key = key.wrapping_mul(0xff51_afd7_ed55_8ccd);
+    key ^= key >> 33;
+    key.max(1)
+}
+
+/// Whether the process that claimed a slot is still running. A crashed
+/// owner's claims are taken over.
+#[cfg(target_os = "linux")]
+fn alive(pid: libc::pid_t) -> bool {
+    let signalled = unsafe { libc::kill(pid, 0) };
+    signalled == 0 || io::Error::last_os_error().raw_os_error() == Some(libc::EPERM)
+}
+
+#[cfg(target_os = "linux")]
+fn now() -> u64 {
+    std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |elapsed| elapsed.as_secs())
+}
+
+#[cfg(not(target_os = "linux"))]
+impl SharedCache {
+    pub fn open(_path: &Path) -> io::Result<SharedCache> {
+        Err(io::Error::new(
+            io::ErrorKind::Unsupported,
+            "shared caches need Linux",
+        ))
+    }
+
+    pub fn claim(&self, _path: &Path) -> Option<Claim> {
+        None
+    }
+
+    fn wait(&self, _path: &Path) {}
+
+    pub fn finish(&self, _slot: usize, _total: u64) {}
+
+    pub fn release(&self, _slot: usize) {}
+}
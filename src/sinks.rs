@@ -0,0 +1,226 @@
+//! Extra outputs of one scan. Each sink runs on its own thread with its
+//! own buffered writer and is fed through a short queue: live totals are
+//! offered without waiting and dropped when a sink falls behind, since the
+//! next ones supersede them, so a slow sink never holds up the traversal.
+//! Only the final results are waited on.
+
+use crate::options::{SinkKind, SinkSpec};
+use crate::watch::json_string;
+use std::fs::{self, File};
+use std::io::{self, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, SyncSender};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+/// Events queued per sink before live totals start being dropped.
+const QUEUE: usize = 16;
+const INTERVAL: Duration = Duration::from_millis(200);
+
+type Totals = Arc<[(String, u64)]>;
+
+enum Event {
+    /// Lower bounds on every total while the scan runs.
+    Progress(Totals),
+    /// The results and how long the scan took.
+    Final(Totals, Duration),
+}
+
+struct Sink {
+    events: SyncSender<Event>,
+    live: bool,
+    writer: JoinHandle<io::Result<()>>,
+    destination: PathBuf,
+}
+
+pub struct Sinks {
+    sinks: Vec<Sink>,
+    started: Instant,
+}
+
+impl Sinks {
+    /// Starts a thread per sink. Exits if a destination cannot be created.
+    pub fn open(specs: &[SinkSpec]) -> Sinks {
+        let sinks = specs
+            .iter()
+            .map(|spec| {
+                let out = open(&spec.destination, spec.kind).unwrap_or_else(|error| {
+                    eprintln!(
+                        "dirsize: cannot write {}: {error}",
+                        spec.destination.display()
+                    );
+                    std::process::exit(1);
+                });
+                let (events, receiver) = mpsc::sync_channel(QUEUE);
+                let kind = spec.kind;
+                let destination = spec.destination.clone();
+                Sink {
+                    events,
+                    live: matches!(kind, SinkKind::Ndjson),
+                    writer: thread::spawn(move || write(kind, out, receiver, &destination)),
+                    destination: spec.destination.clone(),
+                }
+            })
+            .collect();
+        Sinks {
+            sinks,
+            started: Instant::now(),
+        }
+    }
+
+    /// Runs `scan`, offering the live `totals` to sinks that stream them.
+    pub fn run<R: Send>(
+        &self,
+        names: &[String],
+        totals: &[AtomicU64],
+        scan: impl FnOnce() -> R + Send,
+    ) -> R {
+        if !self.sinks.iter().any(|sink| sink.live) {
+            return scan();
+        }
+        let done = AtomicBool::new(false);
+        let reporter = thread::current();
+        thread::scope(|scope| {
+            let scanner = scope.spawn(|| {
+                let result = scan();
+                done.store(true, Ordering::Release);
+                reporter.unpark();
+                result
+            });
+            while !done.load(Ordering::Acquire) {
+                let snapshot: Totals = names
+                    .iter()
+                    .zip(totals)
+                    .map(|(name, total)| (name.clone(), total.load(Ordering::Relaxed)))
+                    .collect();
+                for sink in self.sinks.iter().filter(|sink| sink.live) {
+                    let _ = sink.events.try_send(Event::Progress(snapshot.clone()));
+                }
+                thread::park_timeout(INTERVAL);
+            }
+            scanner.join().unwrap()
+        })
+    }
+
+    /// Hands every sink the results and waits for all of them to finish
+    /// writing. Returns false if any of them failed.
+    pub fn finish(self, directory_sizes: &[(String, u64)]) -> bool {
+        let results: Totals = directory_sizes.into();
+        let elapsed = self.started.elapsed();
+        let mut ok = true;
+        for sink in self.sinks {
+            // A writer only stops reading early when it has failed, and then
+            // its error is the one to report.
+            let _ = sink.events.send(Event::Final(results.clone(), elapsed));
+            drop(sink.events);
+            if let Err(error) = sink.writer.join().unwrap() {
+                eprintln!(
+                    "dirsize: cannot write {}: {error}",
+                    sink.destination.display()
+                );
+                ok = false;
+            }
+        }
+        ok
+    }
+}
+
+/// Stdout for `-`. Prometheus files are written under a temporary name and
+/// renamed when complete, so a collector never reads half a file.
+fn open(destination: &Path, kind: SinkKind) -> io::Result<BufWriter<Box<dyn Write + Send>>> {
+    let out: Box<dyn Write + Send> = if destination == Path::new("-") {
+        Box::new(io::stdout())
+    } else if let SinkKind::Prometheus = kind {
+        Box::new(File::create(temporary(destination))?)
+    } else {
+        Box::new(File::create(destination)?)
+    };
+    Ok(BufWriter::new(out))
+}
+
+fn temporary(destination: &Path) -> PathBuf {
+    let mut temporary = destination.as_os_str().to_owned();
+    temporary.push(".tmp");
+    PathBuf::from(temporary)
+}
+
+fn write(
+    kind: SinkKind,
+    mut out: BufWriter<Box<dyn Write + Send>>,
+    events: Receiver<Event>,
+    destination: &Path,
+) -> io::Result<()> {
+    let mut last: Vec<Option<u64>> = Vec::new();
+    for event in events {
+        match (kind, event) {
+            (SinkKind::Ndjson, Event::Progress(totals)) => {
+                last.resize(totals.len(), None);
+                for ((path, size), last) in totals.iter().zip(&mut last) {
+                    if *last != Some(*size) {
+                        *last = Some(*size);
+                        writeln!(
+                            out,
+                            "{{\"event\":\"progress\",\"path\":{},\"size\":{size},\"final\":false}}",
+                            json_string(path)
+                        )?;
+                    }
+                }
+                out.flush()?;
+            }
+            (_, Event::Progress(_)) => {}
+            (SinkKind::Ndjson, Event::Final(results, _)) => {
+                for (path, size) in results.iter() {
+                    writeln!(
+                        out,
+                        "{{\"event\":\"progress\",\"path\":{},\"size\":{size},\"final\":true}}",
+                        json_string(path)
+                    )?;
+                }
+            }
+            (SinkKind::Text, Event::Final(results, _)) => {
+                for (path, size) in results.iter() {
+                    writeln!(out, "{path}: {size} bytes")?;
+                }
+            }
+            (SinkKind::Top(count), Event::Final(results, _)) => {
+                let mut largest: Vec<_> = results.iter().collect();
+                largest.sort_by(|a, b| b.1.cmp(&a.1).then_with(|| a.0.cmp(&b.0)));
+                for (path, size) in largest.into_iter().take(count) {
+                    writeln!(out, "{path}: {size} bytes")?;
+                }
+            }
+            (SinkKind::Prometheus, Event::Final(results, elapsed)) => {
+                writeln!(
+                    out,
+                    "# HELP dirsize_directory_bytes Total size of a scanned directory."
+                )?;
+                writeln!(out, "# TYPE dirsize_directory_bytes gauge")?;
+                for (path, size) in results.iter() {
+                    writeln!(
+                        out,
+                        "dirsize_directory_bytes{{path=\"{}\"}} {size}",
+                        label(path)
+                    )?;
+                }
+                writeln!(out, "# HELP dirsize_scan_seconds Duration of the scan.")?;
+                writeln!(out, "# TYPE dirsize_scan_seconds gauge")?;
+                writeln!(out, "dirsize_scan_seconds {:.6}", elapsed.as_secs_f64())?;
+                out.flush()?;
+                if destination != Path::new("-") {
+                    fs::rename(temporary(destination), destination)?;
+                }
+            }
+        }
+    }
+    out.flush()
+}
+
+/// Escapes a Prometheus label value.
+fn label(value: &str) -> String {
+    value
+        .replace('\\', "\\\\")
+        .replace('"', "\\\"")
+        .replace('\n', "\\n")
+}
@@ -0,0 +1,178 @@
+//! Adaptive limit on concurrent directory reads. The window grows by one
+//! reader per interval while reads stay fast and the host's I/O is calm,
+//! and halves when listing latency climbs well above the best seen or the
+//! kernel reports tasks stalled on I/O, so a scan yields to a busy host
+//! and speeds up again once it is idle.
+
+use crate::listing::{self, Listing};
+use std::path::{Path, PathBuf};
+use std::sync::{Condvar, Mutex};
+use std::time::{Duration, Instant};
+
+/// How often the window is adjusted.
+const INTERVAL: Duration = Duration::from_millis(100);
+/// Interval latency per entry above this multiple of the baseline is
+/// treated as congestion.
+const LATENCY_FACTOR: f64 = 2.0;
+/// The baseline drifts up by this factor per interval so that a lucky
+/// early minimum does not pin the throttle down forever.
+const BASELINE_DRIFT: f64 = 1.01;
+/// Fraction of wall time some task spent stalled on I/O, from PSI, above
+/// which the host counts as stressed.
+const PRESSURE_LIMIT: f64 = 0.10;
+
+struct Window {
+    limit: usize,
+    active: usize,
+    started: Instant,
+    seconds: f64,
+    entries: u64,
+    baseline: Option<f64>,
+    pressure: Option<(u64, Instant)>,
+    backoffs: u64,
+    lowest: usize,
+}
+
+pub struct Throttle {
+    ceiling: usize,
+    pressure_file: Option<PathBuf>,
+    window: Mutex<Window>,
+    released: Condvar,
+}
+
+impl Throttle {
+    /// A throttle allowing between one and `ceiling` concurrent reads,
+    /// starting halfway.
+    pub fn new(ceiling: usize) -> Throttle {
+        let ceiling = ceiling.max(1);
+        let pressure_file = pressure_file();
+        let pressure = pressure_file
+            .as_deref()
+            .and_then(stalled)
+            .map(|stalled| (stalled, Instant::now()));
+        Throttle {
+            ceiling,
+            pressure_file,
+            window: Mutex::new(Window {
+                limit: ceiling.div_ceil(2),
+                active: 0,
+                started: Instant::now(),
+                seconds: 0.0,
+                entries: 0,
+                baseline: None,
+                pressure,
+                backoffs: 0,
+                lowest: ceiling.div_ceil(2),
+            }),
+            released: Condvar::new(),
+        }
+    }
+
+    /// `listing::list_or_size` once a read slot is free, timing the read.
+    pub fn list(&self, path: &Path) -> Listing {
+        let mut window = self.window.lock().unwrap();
+        while window.active >= window.limit {
+            window = self.released.wait(window).unwrap();
+        }
+        window.active += 1;
+        drop(window);
+
+        let started = Instant::now();
+        let listing = listing::list_or_size(path);
+        let elapsed = started.elapsed();
+
+        let mut window = self.window.lock().unwrap();
+        window.active -= 1;
+        window.seconds += elapsed.as_secs_f64();
+        window.entries += listing.entries + 1;
+        if window.started.elapsed() >= INTERVAL {
+            self.adjust(&mut window);
+        }
+        drop(window);
+        self.released.notify_all();
+        listing
+    }
+
+    /// Additive increase when neither signal shows congestion, multiplicative
+    /// decrease when either does.
+    fn adjust(&self, window: &mut Window) {
+        let latency = window.seconds / window.entries.max(1) as f64;
+        let baseline = window
+            .baseline
+            .map_or(latency, |baseline| (baseline * BASELINE_DRIFT).min(latency));
+        window.baseline = Some(baseline);
+
+        let now = Instant::now();
+        let stressed = match (
+            self.pressure_file.as_deref().and_then(stalled),
+            window.pressure,
+        ) {
+            (Some(stalled), Some((before, at))) => {
+                window.pressure = Some((stalled, now));
+                let wall = now.duration_since(at).as_micros().max(1) as f64;
+                stalled.saturating_sub(before) as f64 / wall > PRESSURE_LIMIT
+            }
+            (stalled, _) => {
+                window.pressure = stalled.map(|stalled| (stalled, now));
+                false
+            }
+        };
+
+        if stressed || latency > baseline * LATENCY_FACTOR {
+            window.limit = (window.limit / 2).max(1);
+            window.backoffs += 1;
+            window.lowest = window.lowest.min(window.limit);
+        } else if window.limit < self.ceiling {
+            window.limit += 1;
+        }
+        window.started = now;
+        window.seconds = 0.0;
+        window.entries = 0;
+    }
+
+    pub fn report(&self) {
+        let window = self.window.lock().unwrap();
+        eprintln!(
+            "dirsize: throttle ended at {} of {} readers (lowest {}, {} backoffs, pressure {})",
+            window.limit,
+            self.ceiling,
+            window.lowest,
+            window.backoffs,
+            self.pressure_file
+                .as_deref()
+                .map_or("unavailable".into(), |path| path.display().to_string())
+        );
+    }
+}
+
+/// The cgroup's `io.pressure` when the process runs in a cgroup v2 that
+/// exposes one, else the host-wide `/proc/pressure/io`.
+#[cfg(target_os = "linux")]
+fn pressure_file() -> Option<PathBuf> {
+    let cgroup = std::fs::read_to_string("/proc/self/cgroup").ok();
+    let cgroup = cgroup
+        .as_deref()
+        .and_then(|cgroup| cgroup.lines().find_map(|line| line.strip_prefix("0::")))
+        .map(|relative| Path::new("/sys/fs/cgroup").join(relative.trim_start_matches('/')));
+    cgroup
+        .map(|cgroup| cgroup.join("io.pressure"))
+        .into_iter()
+        .chain([PathBuf::from("/proc/pressure/io")])
+        .find(|path| stalled(path).is_some())
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pressure_file() -> Option<PathBuf> {
+    None
+}
+
+/// Total microseconds in which some task was stalled on I/O, from the
+/// `some ... total=` line of a PSI file.
+fn stalled(path: &Path) -> Option<u64> {
+    let pressure = std::fs::read_to_string(path).ok()?;
+    let some = pressure.lines().find(|line| line.starts_with("some "))?;
+    some.split_whitespace()
+        .find_map(|field| field.strip_prefix("total="))?
+        .parse()
+        .ok()
+}
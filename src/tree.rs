@@ -0,0 +1,473 @@
+use crate::listing::{self, Listing};
+use rayon::prelude::*;
+use std::collections::HashSet;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::time::SystemTime;
+
+/// A directory retained in a live tree. `size` and `entries` are the
+/// directory's own metadata length and entry count; the totals include
+/// every live descendant.
+pub struct Node {
+    pub path: PathBuf,
+    pub parent: Option<usize>,
+    pub children: Vec<usize>,
+    pub size: u64,
+    pub entries: u64,
+    pub total_size: u64,
+    pub total_entries: u64,
+    pub modified: Option<SystemTime>,
+    pub removed: bool,
+}
+
+/// Filesystem events inferred from one refresh of a directory.
+#[derive(Default)]
+pub struct Changes {
+    pub created: u64,
+    pub deleted: u64,
+    pub modified: u64,
+}
+
+impl Changes {
+    pub fn total(&self) -> u64 {
+        self.created + self.deleted + self.modified
+    }
+}
+
+/// Directory tree that stays up to date as directories are refreshed.
+/// Changes are applied as deltas walked up the parent chain, so an update
+/// costs O(depth) no matter how large the tree is.
+pub struct Tree {
+    pub nodes: Vec<Node>,
+    /// Nodes marked removed since the last `compact`.
+    removed: usize,
+}
+
+impl Tree {
+    pub fn scan(root: &Path) -> Tree {
+        Tree {
+            nodes: scan_subtree(root),
+            removed: 0,
+        }
+    }
+
+    /// Drops removed nodes once they make up half the tree, so that a long
+    /// watch over churning directories does not grow without bound. Live
+    /// nodes keep their order. When it compacts, returns the new index of
+    /// every old one, `None` for those dropped, for callers to renumber
+    /// what they hold.
+    pub fn compact(&mut self) -> Option<Vec<Option<usize>>> {
+        if self.removed * 2 < self.nodes.len() || self.nodes[0].removed {
+            return None;
+        }
+        let mut live = 0;
+        let remap: Vec<_> = self
+            .nodes
+            .iter()
+            .map(|node| {
+                (!node.removed).then(|| {
+                    live += 1;
+                    live - 1
+                })
+            })
+            .collect();
+        self.nodes = std::mem::take(&mut self.nodes)
+            .into_iter()
+            .filter(|node| !node.removed)
+            .map(|mut node| {
+                node.parent = node.parent.and_then(|parent| remap[parent]);
+                for child in &mut node.children {
+                    *child = remap[*child].unwrap();
+                }
+                node
+            })
+            .collect();
+        self.removed = 0;
+        Some(remap)
+    }
+
+    /// Follows `path` down from the root through live children.
+    pub fn find(&self, path: &Path) -> Option<usize> {
+        let relative = path.strip_prefix(&self.nodes[0].path).ok()?;
+        let mut index = 0;
+        for component in relative.components() {
+            let child = self.nodes[index].path.join(component);
+            index = *self.nodes[index]
+                .children
+                .iter()
+                .find(|&&child_index| self.nodes[child_index].path == child)?;
+        }
+        Some(index)
+    }
+
+    /// Re-reads one directory. Changes to its own size or entry count and
+    /// added or removed subdirectories are propagated to every ancestor;
+    /// `visit` sees each node whose totals changed.
+    pub fn refresh(&mut self, index: usize, visit: &mut impl FnMut(usize, &Node)) -> Changes {
+        let path = self.nodes[index].path.clone();
+        let Ok(metadata) = fs::metadata(&path) else {
+            self.remove(index, visit);
+            return Changes {
+                deleted: 1,
+                ..Changes::default()
+            };
+        };
+        let modified = metadata.modified().ok();
+        if modified == self.nodes[index].modified && metadata.len() == self.nodes[index].size {
+            return Changes::default();
+        }
+
+        let Listing {
+            entries,
+            subdirectories,
+            ..
+        } = listing::list(&path).unwrap_or_default();
+        let node = &mut self.nodes[index];
+        let size_delta = metadata.len() as i64 - node.size as i64;
+        let entries_delta = entries as i64 - node.entries as i64;
+        node.size = metadata.len();
+        node.entries = entries;
+        node.modified = modified;
+        self.propagate(index, size_delta, entries_delta, visit);
+
+        let listed: HashSet<&Path> = subdirectories.iter().map(PathBuf::as_path).collect();
+        let known: HashSet<&Path> = self.nodes[index]
+            .children
+            .iter()
+            .map(|&child| self.nodes[child].path.as_path())
+            .collect();
+        let created: Vec<PathBuf> = subdirectories
+            .iter()
+            .filter(|subdirectory| !known.contains(subdirectory.as_path()))
+            .cloned()
+            .collect();
+        let (kept, vanished): (Vec<usize>, Vec<usize>) = self.nodes[index]
+            .children
+            .iter()
+            .copied()
+            .partition(|&child| listed.contains(self.nodes[child].path.as_path()));
+
+        let mut changes = Changes::default();
+        self.nodes[index].children = kept;
+        for child in vanished {
+            self.release(child, visit);
+            changes.deleted += 1;
+        }
+        for subdirectory in created {
+            let child = splice(&mut self.nodes, Some(index), scan_subtree(&subdirectory));
+            let (size, entries) = (
+                self.nodes[child].total_size,
+                self.nodes[child].total_entries,
+            );
+            self.propagate(index, size as i64, entries as i64, visit);
+            changes.created += 1;
+        }
+
+        changes.created = changes.created.max(entries_delta.max(0) as u64);
+        changes.deleted = changes.deleted.max((-entries_delta).max(0) as u64);
+        if changes.total() == 0 {
+            changes.modified = 1;
+        }
+        changes
+    }
+
+    fn remove(&mut self, index: usize, visit: &mut impl FnMut(usize, &Node)) {
+        if let Some(parent) = self.nodes[index].parent {
+            self.nodes[parent].children.retain(|&child| child != index);
+        }
+        self.release(index, visit);
+    }
+
+    /// Marks the subtree at `index` removed and subtracts it from its
+    /// ancestors, once it is no longer among its parent's children.
+    fn release(&mut self, index: usize, visit: &mut impl FnMut(usize, &Node)) {
+        let (size, entries) = (
+            self.nodes[index].total_size,
+            self.nodes[index].total_entries,
+        );
+        let mut stack = vec![index];
+        while let Some(current) = stack.pop() {
+            self.nodes[current].removed = true;
+            self.removed += 1;
+            stack.append(&mut self.nodes[current].children);
+        }
+
+        if let Some(parent) = self.nodes[index].parent {
+            self.propagate(parent, -(size as i64), -(entries as i64), visit);
+        }
+    }
+
+    fn propagate(
+        &mut self,
+        index: usize,
+        size_delta: i64,
+        entries_delta: i64,
+        visit: &mut impl FnMut(usize, &Node),
+    ) {
+        if size_delta == 0 && entries_delta == 0 {
+            return;
+        }
+
+        let mut current = Some(index);
+        while let Some(index) = current {
+            let node = &mut self.nodes[index];
+            node.total_size = node.total_size.saturating_add_signed(size_delta);
+            node.total_entries = node.total_entries.saturating_add_signed(entries_delta);
+            visit(index, node);
+            current = node.parent;
+        }
+    }
+}
+
+/// Scans `path` into a standalone subtree whose first node is `path` itself.
+fn scan_subtree(path: &Path) -> Vec<Node> {
+    let builder = Builder::new();
+    let root = builder.build(path);
+    builder.finish(root)
+}
+
+/// Nodes per arena chunk. A full chunk is left in place and a new one
+/// started, so appending never copies the nodes a worker already built.
+const CHUNK: usize = 4096;
+
+/// Low bits of a builder id holding the position within its arena; the
+/// bits above hold the arena.
+const POSITION_BITS: u32 = 48;
+
+/// A node as a worker built it, with children named by builder id.
+struct Built {
+    path: PathBuf,
+    children: Vec<u64>,
+    size: u64,
+    entries: u64,
+    total_size: u64,
+    total_entries: u64,
+    modified: Option<SystemTime>,
+    count: usize,
+}
+
+/// What a parent needs from a finished child without reading its arena.
+#[derive(Clone, Copy)]
+struct Summary {
+    id: u64,
+    total_size: u64,
+    total_entries: u64,
+    count: usize,
+}
+
+/// Builds a subtree from parallel workers without a shared append point.
+/// Each rayon worker pushes the nodes it finishes into its own chunked
+/// arena, so its lock is never contended, and links children by global
+/// id. `finish` then gives every node its final index and moves it there
+/// in parallel.
+struct Builder {
+    arenas: Vec<Mutex<Vec<Vec<Built>>>>,
+}
+
+impl Builder {
+    /// One arena per pool thread plus one for threads outside the pool.
+    fn new() -> Builder {
+        Builder {
+            arenas: (0..=rayon::current_num_threads())
+                .map(|_| Mutex::new(Vec::new()))
+                .collect(),
+        }
+    }
+
+    fn build(&self, path: &Path) -> Summary {
+        let Listing {
+            size,
+            modified,
+            entries,
+            subdirectories,
+            ..
+        } = listing::list_or_size(path);
+
+        let children: Vec<_> = subdirectories
+            .par_iter()
+            .map(|sub_path| self.build(sub_path))
+            .collect();
+
+        let mut built = Built {
+            path: path.to_owned(),
+            children: Vec::with_capacity(children.len()),
+            size,
+            entries,
+            total_size: size,
+            total_entries: entries,
+            modified,
+            count: 1,
+        };
+        for child in children {
+            built.children.push(child.id);
+            built.total_size += child.total_size;
+            built.total_entries += child.total_entries;
+            built.count += child.count;
+        }
+        let summary = Summary {
+            id: 0,
+            total_size: built.total_size,
+            total_entries: built.total_entries,
+            count: built.count,
+        };
+        Summary {
+            id: self.push(built),
+            ..summary
+        }
+    }
+
+    fn push(&self, built: Built) -> u64 {
+        let arena_index = rayon::current_thread_index()
+            .filter(|&index| index + 1 < self.arenas.len())
+            .unwrap_or(self.arenas.len() - 1);
+        let mut arena = self.arenas[arena_index].lock().unwrap();
+        if arena.last().is_none_or(|chunk| chunk.len() == CHUNK) {
+            arena.push(Vec::with_capacity(CHUNK));
+        }
+        let position = (arena.len() - 1) * CHUNK + arena.last().unwrap().len();
+        arena.last_mut().unwrap().push(built);
+        (arena_index as u64) << POSITION_BITS | position as u64
+    }
+
+    /// Lays the subtree out root first, each node followed by its
+    /// children's subtrees in order, which is the layout `Tree` uses. One
+    /// parallel pass from the root assigns final indices and parents; a
+    /// second moves every arena chunk into place.
+    fn finish(self, root: Summary) -> Vec<Node> {
+        let arenas: Vec<Vec<Vec<Built>>> = self
+            .arenas
+            .into_iter()
+            .map(|arena| arena.into_inner().unwrap())
+            .collect();
+        let placement: Vec<Vec<(AtomicUsize, AtomicUsize)>> = arenas
+            .iter()
+            .map(|arena| {
+                let length = arena.iter().map(Vec::len).sum();
+                (0..length)
+                    .map(|_| (AtomicUsize::new(0), AtomicUsize::new(usize::MAX)))
+                    .collect()
+            })
+            .collect();
+        place(&arenas, &placement, root.id, 0, usize::MAX);
+
+        let mut nodes = Vec::with_capacity(root.count);
+        let slots = Slots(nodes.as_mut_ptr());
+        let chunks: Vec<_> = arenas
+            .into_iter()
+            .enumerate()
+            .flat_map(|(arena_index, arena)| {
+                arena
+                    .into_iter()
+                    .enumerate()
+                    .map(move |(chunk_index, chunk)| (arena_index, chunk_index, chunk))
+            })
+            .collect();
+        let written: usize = chunks
+            .into_par_iter()
+            .map(|(arena_index, chunk_index, chunk)| {
+                let length = chunk.len();
+                for (offset, built) in chunk.into_iter().enumerate() {
+                    let (index, parent) = &placement[arena_index][chunk_index * CHUNK + offset];
+                    let parent = parent.load(Ordering::Relaxed);
+                    let node = Node {
+                        path: built.path,
+                        parent: (parent != usize::MAX).then_some(parent),
+                        children: built
+                            .children
+                            .into_iter()
+                            .map(|child| {
+                                let (arena, position) = split_id(child);
+                                placement[arena][position].0.load(Ordering::Relaxed)
+                            })
+                            .collect(),
+                        size: built.size,
+                        entries: built.entries,
+                        total_size: built.total_size,
+                        total_entries: built.total_entries,
+                        modified: built.modified,
+                        removed: false,
+                    };
+                    slots.write(index.load(Ordering::Relaxed), node);
+                }
+                length
+            })
+            .sum();
+
+        assert_eq!(written, root.count);
+        unsafe { nodes.set_len(written) };
+        nodes
+    }
+}
+
+/// Gives the node `id` the final `index` and assigns its children the
+/// ranges that follow, recursing into them in parallel.
+fn place(
+    arenas: &[Vec<Vec<Built>>],
+    placement: &[Vec<(AtomicUsize, AtomicUsize)>],
+    id: u64,
+    index: usize,
+    parent: usize,
+) {
+    let (arena, position) = split_id(id);
+    let (slot_index, slot_parent) = &placement[arena][position];
+    slot_index.store(index, Ordering::Relaxed);
+    slot_parent.store(parent, Ordering::Relaxed);
+
+    let built = &arenas[arena][position / CHUNK][position % CHUNK];
+    let mut next = index + 1;
+    let children: Vec<_> = built
+        .children
+        .iter()
+        .map(|&child| {
+            let (arena, position) = split_id(child);
+            let start = next;
+            next += arenas[arena][position / CHUNK][position % CHUNK].count;
+            (child, start)
+        })
+        .collect();
+    children
+        .par_iter()
+        .for_each(|&(child, start)| place(arenas, placement, child, start, index));
+}
+
+fn split_id(id: u64) -> (usize, usize) {
+    (
+        (id >> POSITION_BITS) as usize,
+        (id & ((1 << POSITION_BITS) - 1)) as usize,
+    )
+}
+
+/// The spare capacity of the final node vector. Every index is written
+/// exactly once, by whichever worker owns the node placed there.
+struct Slots(*mut Node);
+
+unsafe impl Send for Slots {}
+unsafe impl Sync for Slots {}
+
+impl Slots {
+    fn write(&self, index: usize, node: Node) {
+        unsafe { self.0.add(index).write(node) };
+    }
+}
+
+/// Appends `subtree` to `nodes` under `parent` and returns the index of its root.
+fn splice(nodes: &mut Vec<Node>, parent: Option<usize>, subtree: Vec<Node>) -> usize {
+    let offset = nodes.len();
+    for mut node in subtree {
+        node.parent = match node.parent {
+            Some(index) => Some(index + offset),
+            None => parent,
+        };
+        for child in &mut node.children {
+            *child += offset;
+        }
+        nodes.push(node);
+    }
+
+    if let Some(parent) = parent {
+        nodes[parent].children.push(offset);
+    }
+    offset
+}
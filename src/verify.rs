@@ -0,0 +1,356 @@
+//! Differential check of every scan engine against a plain `std::fs` walk,
+//! on an existing directory or on a random tree built for the purpose.
+
+use crate::options::Options;
+use crate::tree::Tree;
+use std::collections::BTreeMap;
+use std::env;
+use std::fs::{self, File};
+use std::io::Write;
+use std::os::unix::fs::{symlink, PermissionsExt};
+use std::panic::{self, AssertUnwindSafe};
+use std::path::{Path, PathBuf};
+use std::process;
+use std::time::{SystemTime, UNIX_EPOCH};
+
+const MAX_DEPTH: u32 = 5;
+const NAME_SUFFIXES: [&str; 4] = ["", " with space", "-ünïcode", "\nnewline"];
+
+/// Top-level directory to (bytes, entries). Engines that only total bytes
+/// report `None` for entries.
+type Totals = BTreeMap<String, (u64, Option<u64>)>;
+type Engine<'a> = (&'static str, Box<dyn Fn() -> Totals + 'a>);
+
+/// Runs every engine on `root`, or on a random tree generated from `seed`
+/// when `root` is `None`, and fails unless all of them agree with the
+/// reference walk on every top-level directory.
+pub fn run(root: Option<&Path>, seed: Option<u64>) -> Result<(), String> {
+    let generated = root.is_none().then(|| {
+        let seed = seed.unwrap_or_else(|| {
+            SystemTime::now()
+                .duration_since(UNIX_EPOCH)
+                .map_or(1, |elapsed| elapsed.as_nanos() as u64)
+        });
+        let root = env::temp_dir().join(format!("dirsize-verify-{}", process::id()));
+        eprintln!(
+            "dirsize: generating tree with seed {seed} in {}",
+            root.display()
+        );
+        let locked = generate(&root, seed);
+        (root, locked)
+    });
+    let root = root.map_or_else(|| generated.as_ref().unwrap().0.clone(), Path::to_owned);
+
+    let expected = reference(&root);
+    let scratch = env::temp_dir().join(format!("dirsize-verify-{}-scratch", process::id()));
+    let engines: Vec<Engine> = vec![
+        (
+            "parallel",
+            Box::new(|| bytes(crate::directory_sizes(&options(&root), None))),
+        ),
+        (
+            "per-device",
+            Box::new(|| {
+                bytes(crate::directory_sizes(
+                    &Options {
+                        per_device: true,
+                        ..options(&root)
+                    },
+                    None,
+                ))
+            }),
+        ),
+        (
+            "rescan-volatile",
+            Box::new(|| {
+                bytes(crate::directory_sizes(
+                    &Options {
+                        consistency: true,
+                        rescan_volatile: true,
+                        ..options(&root)
+                    },
+                    None,
+                ))
+            }),
+        ),
+        (
+            "shared-cache",
+            Box::new(|| {
+                let _ = fs::remove_file(&scratch);
+                bytes(crate::directory_sizes(
+                    &Options {
+                        shared_cache: Some(scratch.clone()),
+                        ..options(&root)
+                    },
+                    None,
+                ))
+            }),
+        ),
+        (
+            "throttle",
+            Box::new(|| {
+                bytes(crate::directory_sizes(
+                    &Options {
+                        throttle: true,
+                        ..options(&root)
+                    },
+                    None,
+                ))
+            }),
+        ),
+        (
+            "arrow",
+            Box::new(|| bytes(crate::export::scan(&root, &scratch, false))),
+        ),
+        ("tree", Box::new(|| tree(&root))),
+    ];
+
+    let mut failures = 0;
+    for (name, engine) in &engines {
+        let result = panic::catch_unwind(AssertUnwindSafe(engine));
+        let verdict = match result {
+            Ok(totals) => {
+                let mismatches = mismatches(&expected, &totals);
+                for mismatch in &mismatches {
+                    eprintln!("dirsize: {name}: {mismatch}");
+                }
+                if mismatches.is_empty() {
+                    "ok".to_owned()
+                } else {
+                    format!("{} mismatches", mismatches.len())
+                }
+            }
+            Err(_) => "panicked".to_owned(),
+        };
+        if verdict != "ok" {
+            failures += 1;
+        }
+        println!("{name}: {verdict}");
+    }
+    let _ = fs::remove_file(&scratch);
+
+    if let Some((root, locked)) = generated {
+        for directory in locked {
+            let _ = fs::set_permissions(directory, fs::Permissions::from_mode(0o755));
+        }
+        let _ = fs::remove_dir_all(root);
+    }
+    match failures {
+        0 => Ok(()),
+        _ => Err(format!(
+            "{failures} engines disagree with the reference walk"
+        )),
+    }
+}
+
+fn options(root: &Path) -> Options {
+    Options {
+        root: root.to_owned(),
+        ..Options::default()
+    }
+}
+
+fn bytes(directory_sizes: Vec<(String, u64)>) -> Totals {
+    directory_sizes
+        .into_iter()
+        .map(|(directory, size)| (directory, (size, None)))
+        .collect()
+}
+
+fn tree(root: &Path) -> Totals {
+    let tree = Tree::scan(root);
+    tree.nodes[0]
+        .children
+        .iter()
+        .map(|&child| {
+            let node = &tree.nodes[child];
+            (
+                node.path.to_str().unwrap().to_owned(),
+                (node.total_size, Some(node.total_entries)),
+            )
+        })
+        .collect()
+}
+
+/// The same totals from `std::fs` alone: a directory's own size plus
+/// everything below it, following symlinks to directories, with unreadable
+/// directories counting only their own size.
+fn reference(root: &Path) -> Totals {
+    fn walk(path: &Path) -> (u64, u64) {
+        let mut size = fs::metadata(path).map_or(0, |metadata| metadata.len());
+        let mut entries = 0;
+        let Ok(read_dir) = fs::read_dir(path) else {
+            return (size, entries);
+        };
+        for entry in read_dir.flatten() {
+            entries += 1;
+            let sub_path = entry.path();
+            if sub_path.is_dir() {
+                let (sub_size, sub_entries) = walk(&sub_path);
+                size += sub_size;
+                entries += sub_entries;
+            }
+        }
+        (size, entries)
+    }
+
+    fs::read_dir(root)
+        .unwrap()
+        .flatten()
+        .map(|entry| entry.path())
+        .filter(|path| path.is_dir())
+        .map(|path| {
+            let (size, entries) = walk(&path);
+            (path.to_str().unwrap().to_owned(), (size, Some(entries)))
+        })
+        .collect()
+}
+
+fn mismatches(expected: &Totals, actual: &Totals) -> Vec<String> {
+    let mut mismatches = Vec::new();
+    for (directory, &(size, entries)) in expected {
+        match actual.get(directory) {
+            None => mismatches.push(format!("{directory:?} missing")),
+            Some(&(actual_size, actual_entries)) => {
+                if actual_size != size {
+                    mismatches.push(format!(
+                        "{directory:?} has {actual_size} bytes, expected {size}"
+                    ));
+                }
+                if let (Some(entries), Some(actual_entries)) = (entries, actual_entries) {
+                    if actual_entries != entries {
+                        mismatches.push(format!(
+                            "{directory:?} has {actual_entries} entries, expected {entries}"
+                        ));
+                    }
+                }
+            }
+        }
+    }
+    for directory in actual.keys() {
+        if !expected.contains_key(directory) {
+            mismatches.push(format!("{directory:?} is not a top-level directory"));
+        }
+    }
+    mismatches
+}
+
+/// xorshift64, enough to make generated trees reproducible from a seed.
+struct Random(u64);
+
+impl Random {
+    fn below(&mut self, bound: u64) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0 % bound
+    }
+}
+
+/// Builds a random tree at `root` with regular, sparse and hard-linked
+/// files, symlinks to files and to finished directories elsewhere in the
+/// tree, dangling symlinks, symlink loops, one directory symlink back to
+/// an ancestor once the tree is deep enough and unreadable directories.
+/// Other directory symlinks
+/// only point at directories whose subtree is already complete and does
+/// not hold the ancestor link, so the only cycle is that one and a scan
+/// follows it until the kernel's symlink limit ends the path with `ELOOP`.
+/// Returns the directories made unreadable, which only stop a scan when
+/// not running as root.
+fn generate(root: &Path, seed: u64) -> Vec<PathBuf> {
+    struct Generated {
+        random: Random,
+        files: Vec<PathBuf>,
+        directories: Vec<PathBuf>,
+        locked: Vec<PathBuf>,
+        looped: bool,
+        /// Depth of the ancestor the loop points at while its subtree is
+        /// still being built; directories on the way to it are not linked.
+        loop_target: Option<u32>,
+    }
+
+    fn populate(directory: &Path, depth: u32, state: &mut Generated) {
+        fs::create_dir_all(directory).unwrap();
+        for file in 0..state.random.below(12) {
+            let suffix = NAME_SUFFIXES[state.random.below(NAME_SUFFIXES.len() as u64) as usize];
+            let path = directory.join(format!("f{file}{suffix}"));
+            let existing = match state.files.len() as u64 {
+                0 => None,
+                count => Some(state.files[state.random.below(count) as usize].clone()),
+            };
+            match (state.random.below(8), existing) {
+                (3, _) => {
+                    let size = 1 << (20 + state.random.below(20));
+                    File::create(&path).unwrap().set_len(size).unwrap();
+                }
+                (4, Some(existing)) => fs::hard_link(existing, &path).unwrap(),
+                (5, Some(existing)) => symlink(existing, &path).unwrap(),
+                (6, _) => symlink("missing", &path).unwrap(),
+                (7, _) => {
+                    let other = directory.join(format!("f{file}{suffix}-loop"));
+                    symlink(&other, &path).unwrap();
+                    symlink(&path, &other).unwrap();
+                }
+                _ => {
+                    let length = state.random.below(4096) as usize;
+                    File::create(&path)
+                        .unwrap()
+                        .write_all(&vec![b'x'; length])
+                        .unwrap();
+                    state.files.push(path);
+                }
+            }
+        }
+
+        if depth < MAX_DEPTH {
+            let fanout = if depth == 0 { 6 } else { 4 };
+            for sub in 0..state.random.below(fanout) {
+                populate(&directory.join(format!("d{sub}")), depth + 1, state);
+            }
+        }
+        if depth > 1 && !state.looped {
+            let levels = 1 + state.random.below(u64::from(depth - 1).min(2)) as u32;
+            symlink("../".repeat(levels as usize), directory.join("up")).unwrap();
+            state.looped = true;
+            state.loop_target = Some(depth - levels);
+        }
+        if depth > 0 && state.random.below(8) == 0 && !state.directories.is_empty() {
+            let target = state.directories
+                [state.random.below(state.directories.len() as u64) as usize]
+                .clone();
+            symlink(target, directory.join("linked")).unwrap();
+        }
+        if depth > 0 && state.random.below(10) == 0 {
+            fs::set_permissions(directory, fs::Permissions::from_mode(0o000)).unwrap();
+            state.locked.push(directory.to_owned());
+        } else if state.loop_target.is_none_or(|target| depth < target) {
+            state.directories.push(directory.to_owned());
+        }
+        if state.loop_target == Some(depth) {
+            state.loop_target = None;
+        }
+    }
+
+    let mut state = Generated {
+        random: Random(seed.max(1)),
+        files: Vec::new(),
+        directories: Vec::new(),
+        locked: Vec::new(),
+        looped: false,
+        loop_target: None,
+    };
+    populate(root, 0, &mut state);
+    state.locked
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn engines_agree_on_generated_trees() {
+        for seed in [1, 42, 99, 1234] {
+            assert_eq!(run(None, Some(seed)), Ok(()), "seed {seed}");
+        }
+    }
+}
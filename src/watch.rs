@@ -0,0 +1,705 @@
+use crate::churn::Churn;
+use crate::inotify::{self, Watcher};
+use crate::options::{Metric, Options, ThresholdSpec};
+use crate::tree::{Node, Tree};
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, HashMap, HashSet, VecDeque};
+use std::fs;
+use std::io::{self, BufRead};
+use std::path::{Path, PathBuf};
+use std::process::{Child, Command};
+use std::sync::mpsc::{self, Receiver};
+use std::thread;
+use std::time::{Duration, Instant};
+
+struct Threshold {
+    spec: ThresholdSpec,
+    node: Option<usize>,
+    value: u64,
+    above: bool,
+    pending: Option<Instant>,
+}
+
+/// Checks registered thresholds as updates walk up the live tree. Each
+/// node visited costs one hash lookup, so evaluation stays O(depth) per
+/// update. A crossing is only reported once it has held for `debounce`.
+struct Monitor {
+    thresholds: Vec<Threshold>,
+    by_node: HashMap<usize, Vec<usize>>,
+    exec: Option<String>,
+    debounce: Duration,
+    hooks: Vec<Child>,
+}
+
+impl Monitor {
+    fn new(options: &Options) -> Monitor {
+        let thresholds = options
+            .thresholds
+            .iter()
+            .map(|spec| Threshold {
+                spec: ThresholdSpec {
+                    path: fs::canonicalize(&spec.path).unwrap_or_else(|_| spec.path.clone()),
+                    metric: spec.metric,
+                    limit: spec.limit,
+                },
+                node: None,
+                value: 0,
+                above: false,
+                pending: None,
+            })
+            .collect();
+
+        Monitor {
+            thresholds,
+            by_node: HashMap::new(),
+            exec: options.exec.clone(),
+            debounce: options.debounce,
+            hooks: Vec::new(),
+        }
+    }
+
+    /// Binds thresholds whose directory is missing from the tree, which
+    /// covers both the first pass and directories that were recreated.
+    fn bind(&mut self, tree: &Tree) {
+        for (id, threshold) in self.thresholds.iter_mut().enumerate() {
+            if threshold
+                .node
+                .is_some_and(|index| !tree.nodes[index].removed)
+            {
+                continue;
+            }
+            if let Some(old) = threshold.node.take() {
+                self.by_node.remove(&old);
+            }
+            threshold.node = tree.find(&threshold.spec.path);
+            if let Some(index) = threshold.node {
+                self.by_node.entry(index).or_default().push(id);
+            }
+            let value = threshold.node.map(|index| &tree.nodes[index]);
+            observe(threshold, value);
+        }
+    }
+
+    /// Follows bound nodes to their new indices after `Tree::compact`.
+    fn renumber(&mut self, remap: &[Option<usize>]) {
+        self.by_node.clear();
+        for (id, threshold) in self.thresholds.iter_mut().enumerate() {
+            threshold.node = threshold.node.and_then(|index| remap[index]);
+            if let Some(index) = threshold.node {
+                self.by_node.entry(index).or_default().push(id);
+            }
+        }
+    }
+
+    fn visit(&mut self, index: usize, node: &Node) {
+        if let Some(ids) = self.by_node.get(&index) {
+            for &id in ids {
+                observe(&mut self.thresholds[id], Some(node));
+            }
+        }
+    }
+
+    fn flush(&mut self) {
+        let now = Instant::now();
+        for index in 0..self.thresholds.len() {
+            let threshold = &mut self.thresholds[index];
+            match threshold.pending {
+                Some(since) if now.duration_since(since) >= self.debounce => {
+                    threshold.pending = None;
+                    threshold.above = !threshold.above;
+                    self.emit(index);
+                }
+                _ => {}
+            }
+        }
+        self.hooks
+            .retain_mut(|child| matches!(child.try_wait(), Ok(None)));
+    }
+
+    fn emit(&mut self, index: usize) {
+        let threshold = &self.thresholds[index];
+        let path = threshold.spec.path.to_string_lossy();
+        let metric = match threshold.spec.metric {
+            Metric::Bytes => "bytes",
+            Metric::Inodes => "inodes",
+        };
+        let state = if threshold.above { "above" } else { "below" };
+        println!(
+            "{{\"event\":\"threshold\",\"path\":{},\"metric\":\"{metric}\",\"limit\":{},\"value\":{},\"state\":\"{state}\"}}",
+            json_string(&path),
+            threshold.spec.limit,
+            threshold.value
+        );
+
+        if let Some(command) = &self.exec {
+            let hook = Command::new("sh")
+                .arg("-c")
+                .arg(command)
+                .env("DIRSIZE_PATH", path.as_ref())
+                .env("DIRSIZE_METRIC", metric)
+                .env("DIRSIZE_LIMIT", threshold.spec.limit.to_string())
+                .env("DIRSIZE_VALUE", threshold.value.to_string())
+                .env("DIRSIZE_STATE", state)
+                .spawn();
+            match hook {
+                Ok(child) => self.hooks.push(child),
+                Err(error) => eprintln!("dirsize: cannot run hook: {error}"),
+            }
+        }
+    }
+}
+
+fn observe(threshold: &mut Threshold, node: Option<&Node>) {
+    threshold.value = node.map_or(0, |node| match threshold.spec.metric {
+        Metric::Bytes => node.total_size,
+        Metric::Inodes => node.total_entries,
+    });
+    let above = threshold.value >= threshold.spec.limit;
+    if above == threshold.above {
+        threshold.pending = None;
+    } else if threshold.pending.is_none() {
+        threshold.pending = Some(Instant::now());
+    }
+}
+
+pub fn json_string(text: &str) -> String {
+    let mut escaped = String::with_capacity(text.len() + 2);
+    escaped.push('"');
+    for c in text.chars() {
+        match c {
+            '"' => escaped.push_str("\\\""),
+            '\\' => escaped.push_str("\\\\"),
+            c if (c as u32) < 0x20 => escaped.push_str(&format!("\\u{:04x}", c as u32)),
+            c => escaped.push(c),
+        }
+    }
+    escaped.push('"');
+    escaped
+}
+
+/// Polling state for one directory. `volatility` is a moving average of
+/// how often polls found the directory changed, and the poll interval is
+/// the watch interval divided by it: directories that change on every poll
+/// are checked every interval, ones that never do back off to `MAX_BACKOFF`
+/// times the interval. Watched directories sit at that bound as a safety net.
+struct Schedule {
+    interval: Duration,
+    checked: Instant,
+    volatility: f64,
+}
+
+const MAX_BACKOFF: u32 = 64;
+
+/// Weight of the latest poll in `Schedule::volatility`. At one half, each
+/// unchanged poll doubles the interval, as plain exponential backoff would.
+const VOLATILITY_WEIGHT: f64 = 0.5;
+
+/// Token bucket that caps scheduled polls at `polls` per watch interval,
+/// so a large tree cannot turn polling into a rescan of everything each
+/// interval. Due directories wait in order of their due time, which the
+/// volatile ones reach first.
+struct PollBudget {
+    polls: f64,
+    interval: Duration,
+    tokens: f64,
+    refilled: Instant,
+}
+
+impl PollBudget {
+    fn new(polls: usize, interval: Duration) -> PollBudget {
+        PollBudget {
+            polls: polls as f64,
+            interval,
+            tokens: polls as f64,
+            refilled: Instant::now(),
+        }
+    }
+
+    fn refill(&mut self, now: Instant) {
+        let elapsed = now.duration_since(self.refilled).as_secs_f64();
+        let earned = elapsed / self.interval.as_secs_f64().max(f64::EPSILON) * self.polls;
+        self.tokens = (self.tokens + earned).min(self.polls);
+        self.refilled = now;
+    }
+
+    fn take(&mut self) -> bool {
+        if self.tokens < 1.0 {
+            return false;
+        }
+        self.tokens -= 1.0;
+        true
+    }
+
+    /// Time until the next poll may run.
+    fn delay(&self) -> Duration {
+        if self.tokens >= 1.0 {
+            return Duration::ZERO;
+        }
+        self.interval.mul_f64((1.0 - self.tokens) / self.polls)
+    }
+}
+const REPORT_INTERVAL: Duration = Duration::from_secs(60);
+/// Longest a command waits on stdin before the loop picks it up.
+const COMMAND_LATENCY: Duration = Duration::from_millis(250);
+/// Time each pass of the loop spends on queued revalidations.
+const REVALIDATION_SLICE: Duration = Duration::from_millis(50);
+
+/// Keeps the live tree current. Hot directories get inotify watches up to
+/// `budget`; everything else is polled on its own adaptive interval using
+/// the mtime check in `Tree::refresh`.
+struct Session {
+    tree: Tree,
+    monitor: Monitor,
+    churn: Churn,
+    watcher: Watcher,
+    budget: usize,
+    interval: Duration,
+    schedules: Vec<Schedule>,
+    queue: BinaryHeap<Reverse<(Instant, usize)>>,
+    poll_budget: Option<PollBudget>,
+    ttl: Option<Duration>,
+    /// Stale directories under queried subtrees, each queued once however
+    /// many queries cover it.
+    revalidation: VecDeque<usize>,
+    queued: HashSet<usize>,
+    /// Subtrees being revalidated and the paths they were queried by.
+    revalidating: Vec<(usize, PathBuf)>,
+    /// Oldest check among the polled directories of each subtree, or `None`
+    /// when they are all watched or not yet scheduled, so that `size` need
+    /// not walk the subtree. Outdated entries are recomputed when next
+    /// asked for, and an outdated node's ancestors are always outdated too.
+    oldest: Vec<Option<Instant>>,
+    outdated: Vec<bool>,
+}
+
+impl Session {
+    fn check(&mut self, index: usize) -> bool {
+        if self.tree.nodes[index].removed {
+            return false;
+        }
+        let monitor = &mut self.monitor;
+        let changes = self
+            .tree
+            .refresh(index, &mut |index, node| monitor.visit(index, node));
+        self.churn.record(index, &changes);
+        self.schedules[index].checked = Instant::now();
+        self.touch(index);
+        changes.total() > 0
+    }
+
+    /// Marks the oldest check of `index` and of every ancestor outdated,
+    /// after its own check, its watch or its children changed. Nodes added
+    /// to the tree since the last call start out unscheduled and up to date.
+    fn touch(&mut self, index: usize) {
+        self.oldest.resize(self.tree.nodes.len(), None);
+        self.outdated.resize(self.tree.nodes.len(), false);
+        let mut current = Some(index);
+        while let Some(index) = current {
+            if self.outdated[index] {
+                break;
+            }
+            self.outdated[index] = true;
+            current = self.tree.nodes[index].parent;
+        }
+    }
+
+    /// The oldest check in the subtree at `index`, recomputing only the
+    /// outdated nodes below it.
+    fn oldest_check(&mut self, index: usize) -> Option<Instant> {
+        if !self.outdated[index] {
+            return self.oldest[index];
+        }
+        let mut oldest = self
+            .schedules
+            .get(index)
+            .filter(|_| !self.watcher.is_watched(index))
+            .map(|schedule| schedule.checked);
+        for position in 0..self.tree.nodes[index].children.len() {
+            let child = self.tree.nodes[index].children[position];
+            oldest = oldest.into_iter().chain(self.oldest_check(child)).min();
+        }
+        self.oldest[index] = oldest;
+        self.outdated[index] = false;
+        oldest
+    }
+
+    fn poll(&mut self, index: usize) {
+        let changed = self.check(index);
+        if self.tree.nodes[index].removed {
+            return;
+        }
+
+        let schedule = &mut self.schedules[index];
+        let observed = if changed { 1.0 } else { 0.0 };
+        schedule.volatility += (observed - schedule.volatility) * VOLATILITY_WEIGHT;
+        schedule.interval = if self.watcher.is_watched(index) {
+            self.interval * MAX_BACKOFF
+        } else {
+            let volatility = schedule.volatility.max(1.0 / MAX_BACKOFF as f64);
+            self.interval
+                .div_f64(volatility)
+                .min(self.interval * MAX_BACKOFF)
+        };
+        let due = schedule.checked + schedule.interval;
+        self.queue.push(Reverse((due, index)));
+    }
+
+    /// Schedules directories added to the tree since the last call and
+    /// watches them while the budget lasts.
+    fn adopt(&mut self) {
+        let now = Instant::now();
+        for index in self.schedules.len()..self.tree.nodes.len() {
+            self.schedules.push(Schedule {
+                interval: self.interval,
+                checked: now,
+                volatility: 1.0,
+            });
+            if self.watcher.len() < self.budget {
+                self.watcher.watch(index, &self.tree.nodes[index].path);
+            }
+            self.queue.push(Reverse((now + self.interval, index)));
+            self.touch(index);
+        }
+    }
+
+    /// Moves watches onto the directories with the most churn, evicting
+    /// directories that have none.
+    fn rebalance(&mut self) {
+        let hottest = self.churn.hottest(self.budget);
+        let hot: HashSet<usize> = hottest.iter().copied().collect();
+        let mut victims: Option<Vec<usize>> = None;
+        for &index in &hottest {
+            if self.watcher.is_watched(index) || self.tree.nodes[index].removed {
+                continue;
+            }
+            if self.watcher.len() >= self.budget {
+                let victims = victims.get_or_insert_with(|| {
+                    self.watcher
+                        .watched()
+                        .filter(|index| !hot.contains(index))
+                        .collect()
+                });
+                let Some(victim) = victims.pop() else {
+                    break;
+                };
+                self.watcher.unwatch(victim);
+                self.touch(victim);
+            }
+            self.watcher.watch(index, &self.tree.nodes[index].path);
+            self.touch(index);
+        }
+    }
+
+    /// Answers a `size` query from the live tree at once, with the age of
+    /// the subtree's stalest directory: watched ones are current and polled
+    /// ones as old as their last check. Directories older than the TTL are
+    /// queued for revalidation, unless a query above them already did so.
+    /// The age comes from the per-node oldest check, and only subtrees
+    /// holding a stale directory are entered to find them.
+    fn size(&mut self, path: &Path) {
+        let Some(index) = self.find(path) else {
+            return;
+        };
+
+        let now = Instant::now();
+        let oldest = self.oldest_check(index);
+        let age = oldest.map_or(Duration::ZERO, |oldest| now.duration_since(oldest));
+        let is_stale = |checked: Option<Instant>| {
+            self.ttl
+                .is_some_and(|ttl| checked.is_some_and(|checked| now.duration_since(checked) > ttl))
+        };
+        let mut stale = Vec::new();
+        let mut stack = Vec::new();
+        if is_stale(oldest) {
+            stack.push(index);
+        }
+        while let Some(current) = stack.pop() {
+            let children = &self.tree.nodes[current].children;
+            stack.extend(
+                children
+                    .iter()
+                    .filter(|&&child| is_stale(self.oldest[child])),
+            );
+            let checked = self.schedules.get(current).map(|schedule| schedule.checked);
+            if !self.watcher.is_watched(current) && is_stale(checked) {
+                stale.push(current);
+            }
+        }
+
+        let covered = self.covered(index);
+        let node = &self.tree.nodes[index];
+        println!(
+            "{{\"event\":\"size\",\"path\":{},\"size\":{},\"entries\":{},\"age\":{:.1},\"revalidating\":{}}}",
+            json_string(&path.to_string_lossy()),
+            node.total_size,
+            node.total_entries,
+            age.as_secs_f64(),
+            covered || !stale.is_empty()
+        );
+        if covered || stale.is_empty() {
+            return;
+        }
+        self.revalidating.push((index, path.to_owned()));
+        for index in stale {
+            if self.queued.insert(index) {
+                self.revalidation.push_back(index);
+            }
+        }
+    }
+
+    /// Whether `index` or an ancestor is already being revalidated.
+    fn covered(&self, mut index: usize) -> bool {
+        loop {
+            if self.revalidating.iter().any(|&(root, _)| root == index) {
+                return true;
+            }
+            match self.tree.nodes[index].parent {
+                Some(parent) => index = parent,
+                None => return false,
+            }
+        }
+    }
+
+    /// Checks queued directories for up to `REVALIDATION_SLICE`, so that
+    /// queries and polls are not held up behind a large subtree, and
+    /// reports the queried subtrees once the queue has drained.
+    fn revalidate(&mut self) {
+        let started = Instant::now();
+        while started.elapsed() < REVALIDATION_SLICE {
+            let Some(index) = self.revalidation.pop_front() else {
+                break;
+            };
+            self.queued.remove(&index);
+            self.check(index);
+        }
+        if !self.revalidation.is_empty() {
+            return;
+        }
+
+        for (index, path) in self.revalidating.drain(..) {
+            let path = json_string(&path.to_string_lossy());
+            let node = &self.tree.nodes[index];
+            if node.removed {
+                println!("{{\"event\":\"revalidated\",\"path\":{path},\"removed\":true}}");
+            } else {
+                println!(
+                    "{{\"event\":\"revalidated\",\"path\":{path},\"size\":{},\"entries\":{}}}",
+                    node.total_size, node.total_entries
+                );
+            }
+        }
+    }
+
+    fn find(&self, path: &Path) -> Option<usize> {
+        let index = fs::canonicalize(path)
+            .ok()
+            .and_then(|path| self.tree.find(&path));
+        if index.is_none() {
+            eprintln!("dirsize: {} is not in the watched tree", path.display());
+        }
+        index
+    }
+
+    /// Compacts the tree once enough of it has been removed and renumbers
+    /// everything that refers to its nodes.
+    fn compact(&mut self) {
+        let Some(remap) = self.tree.compact() else {
+            return;
+        };
+        let mut old = 0..;
+        self.schedules
+            .retain(|_| remap[old.next().unwrap()].is_some());
+        self.queue = self
+            .queue
+            .drain()
+            .filter_map(|Reverse((due, index))| Some(Reverse((due, remap[index]?))))
+            .collect();
+        self.watcher.renumber(&remap);
+        self.churn.renumber(&remap);
+        self.monitor.renumber(&remap);
+        self.revalidation = self
+            .revalidation
+            .drain(..)
+            .filter_map(|index| remap[index])
+            .collect();
+        self.queued = self.revalidation.iter().copied().collect();
+        self.revalidating = self
+            .revalidating
+            .drain(..)
+            .filter_map(|(index, path)| Some((remap[index]?, path)))
+            .collect();
+        self.oldest = vec![None; self.tree.nodes.len()];
+        self.outdated = vec![true; self.tree.nodes.len()];
+    }
+
+    fn report_coverage(&mut self) {
+        let removed: Vec<_> = self
+            .watcher
+            .watched()
+            .filter(|&index| self.tree.nodes[index].removed)
+            .collect();
+        for index in removed {
+            self.watcher.unwatch(index);
+        }
+
+        let now = Instant::now();
+        let mut directories = 0;
+        let mut total_staleness = 0.0;
+        let mut max_staleness = 0.0f64;
+        for (index, node) in self.tree.nodes.iter().enumerate() {
+            if node.removed {
+                continue;
+            }
+            directories += 1;
+            if !self.watcher.is_watched(index) {
+                let staleness = now
+                    .duration_since(self.schedules[index].checked)
+                    .as_secs_f64();
+                total_staleness += staleness;
+                max_staleness = max_staleness.max(staleness);
+            }
+        }
+
+        println!(
+            "{{\"event\":\"coverage\",\"directories\":{directories},\"watched\":{},\"coverage\":{:.4},\"mean_staleness\":{:.1},\"max_staleness\":{max_staleness:.1}}}",
+            self.watcher.len(),
+            self.watcher.len() as f64 / directories.max(1) as f64,
+            total_staleness / directories.max(1) as f64
+        );
+    }
+}
+
+/// Reads `size PATH` commands from stdin for the watch loop.
+fn read_commands() -> Receiver<PathBuf> {
+    let (sender, receiver) = mpsc::channel();
+    thread::spawn(move || {
+        for line in io::stdin().lock().lines() {
+            let Ok(line) = line else {
+                return;
+            };
+            let line = line.trim();
+            let path = match line.split_once(' ') {
+                Some(("size", path)) => PathBuf::from(path.trim()),
+                _ if line.is_empty() => continue,
+                _ => {
+                    eprintln!("dirsize: unknown command {line}");
+                    continue;
+                }
+            };
+            if sender.send(path).is_err() {
+                return;
+            }
+        }
+    });
+    receiver
+}
+
+/// Watches the tree, reporting threshold crossings, churn and watch
+/// coverage as NDJSON on stdout. `size PATH` on stdin answers with the
+/// live totals and their age straight away; past `--ttl`, the subtree's
+/// stale directories are then revalidated a slice at a time between passes.
+pub fn run(options: &Options, interval: Duration) {
+    let root = fs::canonicalize(&options.root).unwrap();
+    let (watcher, budget) = match Watcher::new() {
+        Ok(watcher) => (
+            watcher,
+            options.watch_budget.unwrap_or_else(inotify::default_budget),
+        ),
+        Err(error) => {
+            eprintln!("dirsize: cannot watch for changes, polling everything: {error}");
+            (Watcher::disabled(), 0)
+        }
+    };
+    let mut session = Session {
+        tree: Tree::scan(&root),
+        monitor: Monitor::new(options),
+        churn: Churn::new(),
+        watcher,
+        budget,
+        interval,
+        schedules: Vec::new(),
+        queue: BinaryHeap::new(),
+        poll_budget: options
+            .poll_budget
+            .map(|polls| PollBudget::new(polls, interval)),
+        ttl: options.ttl,
+        revalidation: VecDeque::new(),
+        queued: HashSet::new(),
+        revalidating: Vec::new(),
+        oldest: Vec::new(),
+        outdated: Vec::new(),
+    };
+    session.adopt();
+    session.monitor.bind(&session.tree);
+    session.monitor.flush();
+    session.report_coverage();
+
+    let commands = read_commands();
+    let mut reported = Instant::now();
+    let mut dirty = Vec::new();
+    loop {
+        let now = Instant::now();
+        let throttle = session
+            .poll_budget
+            .as_mut()
+            .map_or(Duration::ZERO, |budget| {
+                budget.refill(now);
+                budget.delay()
+            });
+        let timeout = session
+            .queue
+            .peek()
+            .map_or(interval, |Reverse((due, _))| {
+                due.saturating_duration_since(now).max(throttle)
+            })
+            .min(interval)
+            .min(COMMAND_LATENCY);
+        let timeout = if session.revalidation.is_empty() {
+            timeout
+        } else {
+            Duration::ZERO
+        };
+        if session.watcher.wait(timeout, &mut dirty) {
+            dirty.extend(session.watcher.watched());
+        }
+        for index in dirty.drain(..) {
+            session.check(index);
+        }
+        while let Ok(path) = commands.try_recv() {
+            session.size(&path);
+        }
+        session.revalidate();
+
+        let now = Instant::now();
+        if let Some(budget) = &mut session.poll_budget {
+            budget.refill(now);
+        }
+        while let Some(&Reverse((due, index))) = session.queue.peek() {
+            if due > now
+                || session
+                    .poll_budget
+                    .as_mut()
+                    .is_some_and(|budget| !budget.take())
+            {
+                break;
+            }
+            session.queue.pop();
+            session.poll(index);
+        }
+        session.adopt();
+
+        session.monitor.bind(&session.tree);
+        session.monitor.flush();
+        if session.churn.apply(&session.tree) {
+            if let Some(count) = options.churn {
+                session.churn.report(&session.tree, count);
+            }
+            session.rebalance();
+        }
+        session.compact();
+        if reported.elapsed() >= REPORT_INTERVAL {
+            session.report_coverage();
+            reported = Instant::now();
+        }
+    }
+}